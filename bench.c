@@ -0,0 +1,102 @@
+/* See LICENSE for license details. */
+
+/* Column inserts and cuts on a tall table, with the dense branch of
+ * cols_insert()/cols_cut() as it was before the column map and as it
+ * ships now: make bench */
+
+#define main csvis_main
+#include "main.c"
+#undef main
+
+#include <time.h>
+
+#define BENCH_ROWS 5000000
+#define BENCH_OPS 4
+
+double now(void);
+void table(void);
+void old_cols_insert(int64_t, int64_t);
+void old_cols_cut(int64_t, int64_t);
+
+double
+now(void)
+	{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+	}
+
+void
+table(void)
+	{
+	if (matrice != NULL)
+		{
+		dense_flat();
+		free_matrix(&matrice->m, matrice->rows);
+		dense_free();
+		free(matrice->buff);
+		free(matrice);
+		}
+	char *buff = xmalloc(BENCH_ROWS * 32 + 1), *p = buff;
+	for (int64_t i = 0; i < BENCH_ROWS; i++)
+		p += sprintf(p, "%lld,a,b,%lld\n", (long long)i, (long long)(i % 97));
+	matrice = calloc(1, sizeof(struct Mat));
+	matrice->buff = buff;
+	matrice->m = write_to_matrix(&matrice->buff, &matrice->rows, &matrice->cols);
+	}
+
+void
+old_cols_insert(int64_t at, int64_t n)
+	{
+	/* Every row grown and shifted */
+	gap_move(matrice->rows);
+	for (int64_t i = 0; i < matrice->rows; i++)
+		{
+		matrice->m[i] = xrealloc(matrice->m[i], (matrice->cols + n) * sizeof(char *));
+		memmove(matrice->m[i] + at + n, matrice->m[i] + at, (matrice->cols - at) * sizeof(char *));
+		for (int64_t j = at; j < at + n; j++)
+			matrice->m[i][j] = NULL;
+		}
+	matrice->cols += n;
+	}
+
+void
+old_cols_cut(int64_t at, int64_t n)
+	{
+	gap_move(matrice->rows);
+	for (int64_t i = 0; i < matrice->rows; i++)
+		memmove(matrice->m[i] + at, matrice->m[i] + at + n, (matrice->cols - at - n) * sizeof(char *));
+	matrice->cols -= n;
+	}
+
+int
+main(void)
+	{
+	jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (jobs < 1) jobs = 1;
+	double t, insert, cut;
+	printf("%d rows, %d column inserts then cuts\n", BENCH_ROWS, BENCH_OPS);
+
+	table();
+	t = now();
+	for (int i = 0; i < BENCH_OPS; i++)
+		old_cols_insert(1, 1);
+	insert = now() - t;
+	t = now();
+	for (int i = 0; i < BENCH_OPS; i++)
+		old_cols_cut(1, 1);
+	cut = now() - t;
+	printf("before, every row widened: insert %.6fs, cut %.6fs\n", insert, cut);
+
+	table();
+	t = now();
+	for (int i = 0; i < BENCH_OPS; i++)
+		cols_insert(1, 1);
+	insert = now() - t;
+	t = now();
+	for (int i = 0; i < BENCH_OPS; i++)
+		cols_cut(1, 1);
+	cut = now() - t;
+	printf("now, column map:           insert %.6fs, cut %.6fs\n", insert, cut);
+	return 0;
+	}
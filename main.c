@@ -1,6 +1,7 @@
 /* See LICENSE for license details. */
 
 #define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
 
 #include <stdlib.h>
 #include <curses.h>
@@ -16,13 +17,63 @@
 #include <regex.h>
 #include <ctype.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <dirent.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <malloc.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 char *argv0;
 #include "arg.h"
 
 #define PIPE_BUF 4096
 #define READALL_CHUNK 262144
+#define PARSE_CHUNK 4194304
+#define LOAD_CHUNK 1048576
+#define LOAD_ASYNC 67108864
+#define LOAD_TICK 100
+#define LOAD_KEYS 64 /* keys typed while waiting on the loader that are kept */
+#define FRAME_MS 16 /* shortest time between two frames, about 60 a second */
+#define PERF_BUCKETS 256 /* four per power of two microseconds */
+#define PERF_OVERLAY 30 /* width of the :overlay corner */
+#define JOIN_ROWS 65536
+#define SNIFF_BYTES 262144
+#define SNIFF_STRIDES 4
+#define SNIFF_STRIDE 32768
+#define VIRT_ROWS 256
+#define VIRT_BYTES 65536
+#define VIRT_CACHE 64
+#define NEWROW ((int64_t)1 << 62)
+#define COL_NULL INT64_MIN /* missing cell of a number column */
+#define COL_EMPTY (INT64_MIN + 1) /* empty field of a number column */
+#define COL_DIGITS 17
+#define COL_TEXT (COL_DIGITS + 5) /* a formatted number with its sign, point and NUL */
+#define DICT_MAX 65535
+#define DICT_RATIO 4
+#define ARENA_CHUNK 65536
+#define ARENA_BIG (ARENA_CHUNK / 4)
+#define GAP_ROWS 4096
+#define INTERN_MIN 1024
+#define SEARCH_MEMO 4096
+#define DISP_CACHE 4096
+#define FIT_MIN 4 /* narrowest fitted column, with the space after it */
+#define FIT_MAX 32 /* widest fitted column */
+#define FIT_SHARE 90 /* percent of the sampled cells a fitted column shows whole */
+#define FIT_HEAD 1024 /* rows sampled in order before the random ones */
+#define FIT_SAMPLE 1048576 /* cells sampled in all */
+#define FIT_CELLS 16384 /* cells measured between two looks at the keyboard */
+#define FIT_COLS 4096 /* columns fitted, the others keep cell_width */
+#define PACK_TAG 0x80000000u /* ref is an index into pack->str */
+#define PACK_MAX (PACK_TAG - 1) /* text that offsets can reach */
+#define SPARSE_COLS 64 /* narrower tables stay dense */
+#define SPARSE_RATIO 4 /* sparse when fewer than one cell in SPARSE_RATIO holds text */
+#define INDEX_EXT ".csvis-idx"
+#define INDEX_MAGIC "csvidx2"
+#define INDEX_HASH 65536
 #define SHELL "/bin/sh"
 #define FIFO "/tmp/pyfifo"
 #define XCLIP_COPY "xclip -selection clipboard -i"
@@ -47,10 +98,29 @@ enum {
 	Paste,
 	DeleteCell,
 	PasteCell,
+	Separator,
 	Undo,
 	Redo
 };
 
+enum {
+	ColNum,
+	ColDict,
+	ColText
+};
+
+enum {
+	PerfRead,
+	PerfParse,
+	PerfDraw,
+	PerfSearch,
+	PerfPipe,
+	PerfWrite,
+	PerfCalc,
+	PerfKey,
+	PerfOps
+};
+
 typedef union {
 	int i;
 } Arg;
@@ -65,14 +135,14 @@ struct undo {
 	int operation;
 	char ***mat;
 	char *cell;
-	int rows;
-	int cols;
-	int y;
-	int x;
-	int s_y;
-	int s_x;
-	int loc_y;
-	int loc_x;
+	int64_t rows;
+	int64_t cols;
+	int64_t y;
+	int64_t x;
+	int64_t s_y;
+	int64_t s_x;
+	int64_t loc_y;
+	int64_t loc_x;
 };
 
 typedef struct node {
@@ -83,12 +153,276 @@ typedef struct node {
 } node_t;
 node_t *uhead = NULL;
 
+struct Slab {
+	char *buff;
+	size_t size;
+};
+
+struct Arena {
+	struct Slab *slab;
+	int64_t n;
+	char *pos; /* free bytes of the last small slab */
+	char *end;
+	size_t bytes; /* handed out since the last compaction */
+	char **set; /* open addressing on the shared strings, with -i */
+	size_t cap;
+	size_t used;
+};
+
 struct Mat {
 	char ***m;
+	int64_t gap; /* rows of m before the unused row pointers */
+	int64_t gap_len;
+	int64_t *colmap; /* slot of every column, NULL if the rows hold them in order */
+	int64_t width; /* slots in the rows of m, the rest are in xcol */
+	char ***xcol; /* one array of cells per slot, laid out like m */
+	int64_t n_xcol;
+	int64_t *spare; /* slots of cut columns */
+	int64_t n_spare;
+	int64_t rows;
+	int64_t cols;
+	char *buff;
+	size_t size;
+	size_t mapsize; /* length of buff mapping, 0 if malloced */
+	dev_t dev; /* the mapped file, whatever name it is saved under */
+	ino_t ino;
+	struct Virt *virt; /* rows split on demand, NULL if m holds every cell */
+	struct Column *col; /* typed columns, NULL if m holds every cell */
+	struct Pack *pack; /* cells as 32-bit refs, NULL if m holds every cell */
+	struct SparseRow *sparse; /* only the cells that hold text, NULL if m holds every cell */
+	struct Arena arena; /* edited and pasted strings */
+	char **texts; /* other buffers cells point into, freed with the table */
+	int n_texts;
+};
+
+struct Parse {
+	char ***matrix;
+	int64_t *widths; /* columns allocated for each row until the chunk is padded */
+	char **cells; /* cells of the row being split */
+	int64_t row;
+	int64_t col;
+	int64_t row_s;
+	int64_t col_s;
+	int64_t cols_max;
+	int64_t width; /* columns to pad rows to */
+	char *start; /* start of current cell */
+	char *begin; /* chunk of the buffer to parse */
+	char *end;
+	int quoted; /* quote state at begin */
+	int parity; /* whether the chunk flips the quote state */
+	int redo; /* parsed with the wrong quote state */
+};
+
+struct Frame {
+	int64_t s_y; /* cell in the top left corner */
+	int64_t s_x;
+	int scr_y;
+	int scr_x;
 	int rows;
 	int cols;
-	char *buff;
+	unsigned long layout;
+	int64_t ch[4]; /* selection */
+};
+
+struct Disp {
+	char *cell;
+	int width;
+	unsigned long gen;
+};
+
+struct Load {
+	pthread_t tid;
+	pthread_mutex_t lock;
+	char *pos; /* next byte to parse */
+	char *end;
+	int quoted;
+	int64_t cols; /* widest row so far */
+	char ***m; /* parsed rows not yet moved to matrice */
+	int64_t rows;
+	int stop;
+	int finished;
+	size_t loaded; /* bytes taken in by load_rows() */
+	int virt; /* only index the rows, for matrice->virt */
+	struct Index *index; /* their entries not yet moved to matrice->virt */
+	int64_t n;
+};
+
+struct Perf {
+	uint64_t n;
+	int64_t last; /* microseconds */
+	int64_t max;
+	uint64_t hist[PERF_BUCKETS];
+};
+
+struct Fit {
+	int64_t cols; /* columns with a histogram */
+	int64_t seen; /* rows sampled */
+	uint32_t *hist; /* FIT_MAX counts of text widths per column */
+	char *hand; /* columns resized by hand or inserted, left as they are */
+	uint64_t rng;
+	int idle; /* every row there is was sampled, more may come */
+};
+
+struct Follow {
+	int fd; /* -1 once the input has ended */
+	int pipe; /* end of input is final, a regular file may still grow */
+	char *part; /* bytes after the last newline */
+	size_t len;
 	size_t size;
+	int quoted;
+	int fresh; /* the table is only the empty placeholder */
+	int tail; /* keep reading after the end, -F */
+	pid_t pid; /* decompressor feeding fd, 0 for none */
+	char *prog;
+	int failed; /* the decompressor is missing or gave up, the table is not the file */
+};
+
+struct Join {
+	char ***m; /* rows begin to end are joined with fs into out */
+	int64_t begin;
+	int64_t end;
+	int64_t cols;
+	char fs;
+	char *out;
+	size_t len;
+};
+
+struct Dialect {
+	char fs; /* 0 if no candidate splits the lines */
+	int crlf;
+};
+
+struct Codec {
+	char *ext;
+	char *magic;
+	int len;
+	char *prog;
+};
+
+struct Column {
+	int type;
+	union {
+		int64_t *num; /* ColNum, digits times 16 plus the digits after the point */
+		uint16_t *code; /* ColDict, index into dict */
+		char **text; /* ColText */
+		void *data;
+	};
+	int64_t odd_row; /* one cell of ColNum that is not a number, usually the header */
+	char *odd;
+	char **dict; /* strings of ColDict, dict[0] is NULL */
+	int64_t n_dict;
+	int32_t *slot; /* open addressing on the dict strings, -1 if free */
+	size_t cap;
+	char **shown; /* ColNum: text of the numbers read so far, open addressing on shown_num */
+	int64_t *shown_num;
+	size_t n_shown;
+	size_t cap_shown;
+};
+
+struct ColJob {
+	int64_t begin; /* columns begin to end are typed */
+	int64_t end;
+};
+
+struct Pack {
+	uint32_t *ref; /* rows of width cells, 0 for NULL, else offset into base plus 1 */
+	int64_t width;
+	int64_t gap; /* rows before the unused ones */
+	int64_t gap_len;
+	int64_t *map; /* slot of every column */
+	uint32_t **xref; /* one array of cells per slot past width, laid out like ref */
+	int64_t n_xref;
+	int64_t *spare; /* slots of cut columns */
+	int64_t n_spare;
+	char *base;
+	size_t size;
+	char **str; /* cells outside base, edited ones mostly */
+	uint32_t n_str;
+	uint32_t cap;
+	uint32_t *hole; /* entries of str no cell uses */
+	uint32_t n_hole;
+};
+
+struct SparseCell {
+	int64_t col;
+	char *s;
+};
+
+struct SparseRow {
+	int64_t len; /* fields in the row, cells past them are NULL */
+	int32_t n;
+	int32_t cap;
+	struct SparseCell *cell; /* the cells that hold text, by column */
+};
+
+struct Index {
+	size_t off; /* first byte of the row in buff */
+	int64_t row;
+	int quoted; /* quote state at the start of the row */
+};
+
+struct Scan {
+	char *begin;
+	char *end;
+	struct Index *index; /* rows and quote states relative to the chunk */
+	int64_t n;
+	int64_t n_s;
+	int64_t rows;
+	int64_t width[2]; /* widest row if the chunk starts outside, inside quotes */
+	int parity;
+	int nul; /* the chunk was cut short by a NUL */
+};
+
+struct Block {
+	int64_t n; /* index entry the block starts at, -1 if unused */
+	char *buff; /* copy of the rows, split in place */
+	char ***m;
+	int64_t rows;
+	int64_t cols;
+	unsigned long used;
+};
+
+struct Piece {
+	int64_t id; /* file row, or NEWROW and up for inserted rows */
+	int64_t n;
+};
+
+struct Sidecar {
+	char magic[8];
+	size_t size; /* key: the file it was built from */
+	struct timespec mtime;
+	uint64_t hash;
+	char fs;
+	int64_t rows;
+	int64_t cols;
+	int64_t n; /* struct Index entries that follow */
+	size_t end;
+};
+
+struct Virt {
+	struct Index *index; /* every VIRT_ROWS-th row, or more often for long rows */
+	int64_t n;
+	int64_t rows; /* rows in the file */
+	int64_t cols; /* widest row in the file */
+	char *end;
+	char fs; /* separator the index was built for */
+	struct Sidecar head; /* key of the saved index */
+	pthread_t writer; /* saves the index beside the file */
+	int writing;
+	int keyed; /* the index is saved once the loader has it all */
+	struct Block cache[VIRT_CACHE];
+	unsigned long clock;
+	int last; /* cache entry of the last lookup */
+	struct Piece *piece; /* rows of the table, in order */
+	int64_t pieces;
+	int64_t memo_p; /* piece of the last lookup and its first row */
+	int64_t memo_row;
+	int64_t next; /* id of the next inserted row */
+	int64_t *col; /* file column of every column, -1 if inserted */
+	int64_t *key; /* edited rows, open addressing on the row id */
+	char ***val;
+	size_t cap;
+	size_t used;
 };
 
 struct Command {
@@ -115,10 +449,10 @@ void save_view(const Arg *);
 void load_view(const Arg *);
 void resize_cells(const Arg *);
 void mouse();
-void find_deps(CellPos **, int *,  int, int);
+void find_deps(CellPos **, int *, int64_t, int64_t);
 void find_eqs(void);
 char *help(char *);
-char *replace(int, int);
+char *replace(int64_t, int64_t);
 int find_index_by_pos(CellPos);
 void dfs(int, int *, int *, int *);
 int *topological_sort(void);
@@ -127,6 +461,7 @@ void *xmalloc(size_t);
 void *xrealloc(void *, size_t);
 char *xstrdup(const char *);
 void search(const Arg *);
+int search_cell(regex_t *, char *, char *, char **);
 void move_screen_y(int);
 void move_screen_x(int);
 void move_screen_y_step(const Arg *);
@@ -134,14 +469,22 @@ void move_screen_x_step(const Arg *);
 void move_screen(const Arg *);
 int statusbar(char *);
 int readall(FILE *, char **, size_t *);
+size_t mapall(FILE *, char **, size_t *);
 size_t utf8_strlen(const char *);
+size_t ascii_span(const char *, size_t);
+int wc_width(wchar_t);
 int wcswidth_total(const wchar_t *);
 void format_wide_string(wchar_t *, size_t);
 void draw(void);
+void draw_cells(int, int, int, int);
+int selected(int64_t *, int64_t, int64_t);
+int cchar_width(cchar_t *);
+void draw_cell(int, int, char *, int);
+int stable_cells(void);
 void move_y_visual(void);
 void move_x_visual(void);
-void move_y(int);
-void move_x(int);
+void move_y(int64_t);
+void move_x(int64_t);
 void move_x_start();
 void move_x_end();
 void move_x_step(const Arg *);
@@ -150,6 +493,11 @@ void move_y_end();
 void move_y_step(const Arg *);
 void commands();
 void when_resize(void);
+int col_width(int64_t);
+int fit_from(int64_t);
+int64_t fit_left(int64_t);
+int text_width(int);
+void layout_changed(void);
 void insert_row(const Arg *);
 void insert_col(const Arg *);
 void delete_row();
@@ -165,6 +513,7 @@ void write_to_cells(char *, int);
 int pipe_through(char **, ssize_t *, char *);
 void write_to_pipe(const Arg *);
 void reg_init(void);
+char *reg_str(char **, char *);
 void yank_cells();
 void wipe_cells();
 void paste_cells(const Arg *);
@@ -178,8 +527,152 @@ void die(void);
 void quit();
 void nothing();
 int keypress(int);
-char ***write_to_matrix(char **, int *, int *);
-void free_matrix(char ****, int);
+int take_keys(int);
+int64_t now_ms(void);
+int64_t now_us(void);
+int64_t perf_begin(void);
+void perf_end(int, int64_t);
+int perf_bucket(int64_t);
+int64_t perf_floor(int);
+int64_t perf_share(struct Perf *, int);
+void perf_show(void);
+void perf_paint(void);
+void field_end(struct Parse *, char *);
+void row_add(struct Parse *);
+void row_end(struct Parse *, char *);
+void classify_init(void);
+uint64_t prefix_xor(uint64_t);
+void *parse_chunk(void *);
+void unparse_chunk(struct Parse *);
+void *reparse_chunk(void *);
+void *pad_chunk(void *);
+void parallel(void *(*)(void *), void *, size_t, int);
+char ***parse_range(char *, char *, int *, int64_t *, int64_t *);
+char ***write_to_matrix(char **, int64_t *, int64_t *);
+void keep_text(char *);
+void *join_chunk(void *);
+int sniff_lines(char *, char *, char, int, int *);
+int sniff_cmp(const void *, const void *);
+void sniff(char *, char *, struct Dialect *);
+void detect_dialect(char *, char *);
+int split_table(char);
+char *slice_end(char *, char *, size_t);
+void *load_thread(void *);
+void load_start(void);
+void load_run(char *, int, int);
+int load_rows(void);
+int load_wait(int64_t);
+void load_stop(void);
+void fit_start(void);
+int fit_rows(void);
+void fit_update(void);
+int fit_text(const char *);
+void fit_cols_insert(int64_t, int64_t);
+void fit_cols_cut(int64_t, int64_t);
+void fit_free(void);
+void append_rows(char ***, int64_t, int64_t);
+void follow_start(FILE *, int);
+int follow_rows(void);
+void follow_stop(void);
+struct Codec *codec_magic(FILE *);
+struct Codec *codec_ext(char *);
+FILE *codec_open(FILE *, struct Codec *, int, pid_t *);
+void codec_failed(void);
+void free_matrix(char ****, int64_t);
+char **dense_row(int64_t);
+char **dense_cell(int64_t, int64_t);
+int64_t dense_slot(void);
+void dense_flat(void);
+void dense_free(void);
+void gap_move(int64_t);
+char *get_cell(int64_t, int64_t);
+void set_cell(int64_t, int64_t, char *);
+char *take_cell(int64_t, int64_t);
+void rows_insert(int64_t, int64_t);
+void rows_cut(int64_t, int64_t);
+void cols_insert(int64_t, int64_t);
+void cols_cut(int64_t, int64_t);
+void scan_row(struct Scan *, int64_t *, char *, int);
+void *scan_chunk(void *);
+int virt_scan(struct Virt *, char *, char *, int *);
+void virt_grow(struct Index *, int64_t, int64_t, int64_t, char *);
+uint64_t hash_ends(void);
+int index_key(struct Sidecar *);
+int index_read(struct Virt *);
+void *index_write(void *);
+void index_save(struct Virt *);
+int virt_open(void);
+struct Block *virt_block(int64_t, int64_t *);
+int64_t virt_piece(int64_t);
+int64_t virt_id(int64_t);
+char ***virt_row(int64_t, int);
+char *virt_file(int64_t, int64_t);
+char *virt_get(int64_t, int64_t);
+void virt_set(int64_t, int64_t, char *);
+char *virt_take(int64_t, int64_t);
+int64_t virt_split(int64_t);
+void virt_rows_insert(int64_t, int64_t);
+void virt_rows_cut(int64_t, int64_t);
+void virt_cols_insert(int64_t, int64_t);
+void virt_cols_cut(int64_t, int64_t);
+void virt_free(void);
+int col_number(char *, int64_t *);
+char *col_format(int64_t, char *);
+char *col_shown(struct Column *, int64_t);
+void col_drop(struct Column *);
+uint64_t hash_str(char *);
+int col_code(struct Column *, char *, int64_t);
+void col_infer(struct Column *, int64_t);
+void *col_chunk(void *);
+void col_build(void);
+int col_own(void);
+void col_rows(void);
+void col_text(struct Column *);
+size_t col_size(struct Column *);
+char *col_get(int64_t, int64_t);
+void col_set(int64_t, int64_t, char *);
+char *col_take(int64_t, int64_t);
+void col_rows_insert(int64_t, int64_t);
+void col_rows_cut(int64_t, int64_t);
+void col_cols_insert(int64_t, int64_t);
+void col_cols_cut(int64_t, int64_t);
+void col_free(void);
+void pack_build(char *, size_t);
+uint32_t pack_enc(struct Pack *, char *);
+char *pack_dec(struct Pack *, uint32_t);
+void pack_drop(struct Pack *, uint32_t);
+uint32_t *pack_ref(int64_t, int64_t);
+void pack_move(int64_t);
+int64_t pack_slot(void);
+void pack_rows(void);
+char *pack_get(int64_t, int64_t);
+void pack_set(int64_t, int64_t, char *);
+char *pack_take(int64_t, int64_t);
+void pack_rows_insert(int64_t, int64_t);
+void pack_rows_cut(int64_t, int64_t);
+void pack_cols_insert(int64_t, int64_t);
+void pack_cols_cut(int64_t, int64_t);
+void pack_free(void);
+void sparse_build(void);
+int32_t sparse_find(struct SparseRow *, int64_t);
+void sparse_rows(void);
+char *sparse_get(int64_t, int64_t);
+void sparse_set(int64_t, int64_t, char *);
+char *sparse_take(int64_t, int64_t);
+void sparse_rows_insert(int64_t, int64_t);
+void sparse_rows_cut(int64_t, int64_t);
+void sparse_cols_insert(int64_t, int64_t);
+void sparse_cols_cut(int64_t, int64_t);
+void sparse_free(void);
+char *arena_slab(struct Arena *, size_t);
+char *arena_str(const char *);
+int slab_cmp(const void *, const void *);
+int slab_find(struct Arena *, char *);
+char **intern_slot(struct Arena *, const char *);
+char *intern_str(char *);
+void intern_table(void);
+void arena_move(struct Arena *, char **);
+void arena_compact(void);
 void init_ui(void);
 void usage(void);
 
@@ -187,13 +680,13 @@ void usage(void);
 struct Mat *matrice;
 struct Mat *reg;
 int rows, cols;
-int y, x = 0;
+int64_t y, x = 0;
 int c_y, c_x = 0;
-int v_y, v_x = 0;
-int s_y, s_x = 0;
-int s_y0, s_x0 = 0;
-int y_0, x_0 = 0;
-int ch[4] = {0, 0, 0, 0};
+int64_t v_y, v_x = 0;
+int64_t s_y, s_x = 0;
+int64_t s_y0, s_x0 = 0;
+int64_t y_0, x_0 = 0;
+int64_t ch[4] = {0, 0, 0, 0};
 char mode = 'n';
 int scr_x, scr_y;
 char *fname = NULL;
@@ -207,9 +700,48 @@ int num_eq = 0;
 MEVENT event;
 int win_scroll = 1;
 int cell_width = 10;
-int marks[3][4] = {{0, 0, 0, 0}, {0, 0, 0, 0}, {0, 0, 0, 0}};
+int *col_w = NULL; /* fitted widths of the first n_col_w columns, -a */
+int64_t n_col_w = 0;
+int widest = 10; /* widest column, sizes the display cache */
+int *scr_xs = NULL; /* screen x of the columns shown and where the last one ends */
+unsigned long layout_gen = 1; /* bumped when a column changes width */
+struct Frame frame; /* what the last draw() put on the screen */
+int damaged = 1; /* cells changed or something was drawn over them, repaint them all */
+int64_t frame_ms = 0; /* when the main loop last drew */
+int64_t frames_drawn = 0, keys_taken = 0; /* keys handled per frame, :frames */
+int keys_most = 0;
+int timing = 0; /* -t: time the operations below, :perf shows them */
+struct Perf perf[PerfOps];
+const char *perf_name[PerfOps] = {"read", "parse", "draw", "search", "pipe", "write", "calculate", "key to paint"};
+int64_t key_at = 0; /* when the keys of the coming frame were read */
+WINDOW *perf_win = NULL; /* :overlay, times of the last frame in the top right corner */
+struct Disp disp[DISP_CACHE]; /* cells last formatted, their text is in disp_text */
+wchar_t *disp_text = NULL;
+int disp_stride = 0;
+unsigned long disp_gen = 1; /* bumped when a cell pointer may show other text */
+int64_t marks[3][4] = {{0, 0, 0, 0}, {0, 0, 0, 0}, {0, 0, 0, 0}};
 int pipe_created = 0;
 time_t m_time;
+void (*classify)(const char *, uint64_t *) = NULL; /* SIMD kernel, NULL for scalar */
+size_t (*ascii)(const char *) = NULL; /* SIMD kernel, NULL for scalar */
+int jobs = 1;
+struct Load *load = NULL; /* background loader, NULL once the file is read */
+struct Follow *follow = NULL; /* input read incrementally, -F or compressed */
+struct Fit *fit = NULL; /* column widths still being sampled, NULL once done */
+char filecell[1]; /* edited rows point here for cells still read from the file */
+int sidecar = 0; /* -s: keep the row index of virtual tables in FILE.csvis-idx */
+int detect = 0; /* -f auto: sniff the dialect before the first parse */
+char *eol = "\n"; /* line ending written by :w */
+int columnar = 0; /* -c: type the columns once the table is read */
+int interning = 0; /* -i: equal cells share one string */
+int packing = 0; /* -p: keep cells as 32-bit refs once the table is read */
+int autofit = 0; /* -a: fit the column widths to their text */
+
+static struct Codec codecs[] = {
+	{".gz", "\x1f\x8b", 2, "gzip"},
+	{".zst", "\x28\xb5\x2f\xfd", 4, "zstd"},
+	{".xz", "\xfd" "7zXZ", 5, "xz"},
+};
 
 static Key keys[] = {
 	{{KEY_RESIZE, -1}, nothing, {0}},
@@ -400,8 +932,23 @@ load_view(const Arg *arg)
 void
 resize_cells(const Arg *arg)
 	{
-	if (cell_width + arg->i < cols && cell_width + arg->i > 3)
+	if (x < n_col_w)
+		{
+		/* A fitted column is resized alone and kept out of the fitting */
+		if (col_w[x] + arg->i < cols && col_w[x] + arg->i > 3)
+			{
+			col_w[x] += arg->i;
+			if (fit != NULL && x < fit->cols)
+				fit->hand[x] = 1;
+			layout_changed();
+			}
+		}
+	else if (cell_width + arg->i < cols && cell_width + arg->i > 3)
+		{
 		cell_width += arg->i;
+		disp_gen++;
+		layout_changed();
+		}
 	}
 
 void
@@ -412,9 +959,12 @@ mouse()
 		if (event.bstate & BUTTON1_PRESSED)
 			{
 				move_y(event.y - c_y);
-				int mx = event.x - c_x;
-				if (mx >= 0) move_x(mx/cell_width);
-				else move_x((mx - cell_width)/cell_width);
+				int k = 0;
+				while (k < scr_x && scr_xs[k + 1] <= event.x)
+					k++;
+				if (k == scr_x)
+					k += (event.x - scr_xs[scr_x]) / cell_width;
+				move_x(s_x + k - x);
 			}
 		else if (event.bstate & BUTTON5_PRESSED) move_screen_y(1);
 		else if (event.bstate & BUTTON4_PRESSED) move_screen_y(-1);
@@ -422,16 +972,17 @@ mouse()
 	}
 
 void
-find_deps(CellPos **deps, int *num_dep,  int y, int x)
+find_deps(CellPos **deps, int *num_dep, int64_t y, int64_t x)
 	{
-	if (matrice->m[y][x] == NULL || *(matrice->m[y][x]) != '=')
+	char *str = get_cell(y, x);
+	if (str == NULL || *str != '=')
 		{
 		statusbar("No dependencies.");
 		return;
 		}
+	str = xstrdup(str); /* get_cell() below may drop it from the cache */
 	const char pattern_start = '$';
 	const char pattern_middle = '.';
-	char *str = matrice->m[y][x];
 	*num_dep = 0;
 	int buf_size = 1;
 
@@ -447,13 +998,14 @@ find_deps(CellPos **deps, int *num_dep,  int y, int x)
 			if (pos_start + 1 < pos_middle && pos_middle + 1 < pos_end)
 				{
 				// get i in j from $i.j
-				int i = atoi(pos_start + 1);
-				int j = atoi(pos_middle + 1);
+				int64_t i = strtoll(pos_start + 1, NULL, 10);
+				int64_t j = strtoll(pos_middle + 1, NULL, 10);
 
 				// if inside matrix
 				if (i >= 0 && i < matrice->rows && j >= 0 && j < matrice->cols)
 					{
-					if (matrice->m[i][j - 1] != NULL && *(matrice->m[i][j - 1]) == '=')
+					char *dep = get_cell(i, j - 1);
+					if (dep != NULL && *dep == '=')
 						{
 						if (*deps == NULL)
 							*deps = xmalloc(sizeof(CellPos));
@@ -471,6 +1023,7 @@ find_deps(CellPos **deps, int *num_dep,  int y, int x)
 			}
 			pos_start = strchr(pos_start, pattern_start);
 		}
+	free(str);
 	}
 
 void
@@ -478,11 +1031,12 @@ find_eqs(void)
 	{
 	free(pos_array);
 	num_eq = 0;
-	for (int i = 0; i < matrice->rows; i++)
+	for (int64_t i = 0; i < matrice->rows; i++)
 		{
-		for (int j = 0; j < matrice->cols; j++)
+		for (int64_t j = 0; j < matrice->cols; j++)
 			{
-			if (matrice->m[i][j] != NULL && *matrice->m[i][j] == '=')
+			char *temp = get_cell(i, j);
+			if (temp != NULL && *temp == '=')
 				{
 				if (num_eq == 0)
 					{
@@ -579,12 +1133,13 @@ help(char *val)
 	}
 
 char *
-replace(int y, int x)
+replace(int64_t y, int64_t x)
 	{
-	if (matrice->m[y][x] == NULL || *(matrice->m[y][x]) != '=') return NULL;
+	char *cell = get_cell(y, x);
+	if (cell == NULL || *cell != '=') return NULL;
 	const char pattern_start = '$';
 	const char pattern_middle = '.';
-	char *str = xstrdup(matrice->m[y][x] + 1); // without '='
+	char *str = xstrdup(cell + 1); // without '='
 
 	char *pos_start = strchr(str, pattern_start);
 	while (pos_start != NULL)
@@ -598,13 +1153,13 @@ replace(int y, int x)
 			if (pos_start + 1 < pos_middle && pos_middle + 1 < pos_end)
 				{
 				// get i in j from $i.j
-				int i = atoi(pos_start + 1);
-				int j = atoi(pos_middle + 1);
+				int64_t i = strtoll(pos_start + 1, NULL, 10);
+				int64_t j = strtoll(pos_middle + 1, NULL, 10);
 
 				// if inside matrix
 				if (i >= 0 && i < matrice->rows && j >= 0 && j < matrice->cols)
 					{
-					const char *replacement = matrice->m[i][j];
+					const char *replacement = get_cell(i, j);
 					if (replacement == NULL) replacement = "";
 
 					size_t len_before = pos_start - str;
@@ -670,6 +1225,8 @@ topological_sort(void)
 void
 calculate()
 	{
+	if (!load_wait(INT64_MAX)) return;
+	int64_t t0 = perf_begin();
 	find_eqs();
 
 	if (num_eq == 0)
@@ -683,18 +1240,21 @@ calculate()
 
 	for (int i = 0; i < num_eq; i++)
 		{
-		int y_pos = pos_array[sorted_i[i]].pos.y;
-		int x_pos = pos_array[sorted_i[i]].pos.x;
-		char *undo_cell = matrice->m[y_pos][x_pos + 1];
+		int64_t y_pos = pos_array[sorted_i[i]].pos.y;
+		int64_t x_pos = pos_array[sorted_i[i]].pos.x;
 		char *temp = replace(y_pos, x_pos);
-		char *paste_cell = help(temp);
+		char *result = help(temp);
+		char *paste_cell = arena_str(result);
 		free(temp);
-		matrice->m[y_pos][x_pos + 1] = paste_cell;
+		free(result);
+		char *undo_cell = take_cell(y_pos, x_pos + 1);
+		set_cell(y_pos, x_pos + 1, paste_cell);
 		data[i*2] = (struct undo){DeleteCell, NULL, undo_cell, rows, cols, y, x, s_y, s_x, y_pos, x_pos + 1};
 		data[i*2 + 1] = (struct undo){PasteCell, NULL, paste_cell, rows, cols, y, x, s_y, s_x, y_pos, x_pos + 1};
 		}
 	push(&uhead, data, 2*num_eq);
 	free(sorted_i);
+	perf_end(PerfCalc, t0);
 	}
 
 void *
@@ -744,7 +1304,7 @@ search(const Arg *arg)
 	char *str;
 	static int dir = 0;
 	static int sel = 0;
-	static int ch0, ch1, ch2, ch3;
+	static int64_t ch0, ch1, ch2, ch3;
 	if (arg->i == 0 || arg->i == 2 || arg->i == 4 || arg->i == 5)
 		{
 		str = get_str("", 0, '/');
@@ -787,9 +1347,12 @@ search(const Arg *arg)
 		return;
 		}
 
-	int st_y;
-	int st_x;
-	char *temp;
+	int64_t st_y;
+	int64_t st_x;
+	int64_t t0 = perf_begin();
+	/* A string that failed once fails again */
+	char *miss[SEARCH_MEMO] = {0};
+	char **memo = stable_cells() ? miss : NULL;
 	win_scroll = 0;
 	if (arg->i == 0 || arg->i == 4 || (arg->i == 1 && dir == 0) || (arg->i == 3 && dir == 1))
 		{
@@ -805,23 +1368,12 @@ search(const Arg *arg)
 			st_y = y;
 			st_x = x;
 			}
-		for (int i = st_y; i < ch1; i++)
+		for (int64_t i = st_y; i < ch1; i++)
 			{
-			for (int j = ch2; j < ch3; j++)
+			for (int64_t j = ch2; j < ch3; j++)
 				{
 				if (i == st_y && j <= st_x) continue;
-				temp = matrice->m[i][j];
-				if (temp == NULL)
-					temp = "";
-				if (*str == '\0')
-					{
-					if (*temp == '\0')
-						reti = 0;
-					else
-						reti = 1;
-					}
-				else
-					reti = regexec(&regex, temp, 0, NULL, 0);
+				reti = search_cell(&regex, str, get_cell(i, j), memo);
 				if (!reti)
 					{
 					y = i;
@@ -833,6 +1385,7 @@ search(const Arg *arg)
 						ch[0] = ch[1] = ch[2] = ch[3] = 0;
 						mode = 'n';
 						}
+					perf_end(PerfSearch, t0);
 					regfree(&regex);
 					return;
 					}
@@ -853,23 +1406,12 @@ search(const Arg *arg)
 			st_y = y;
 			st_x = x;
 			}
-		for (int i = st_y; i >= ch0; i--)
+		for (int64_t i = st_y; i >= ch0; i--)
 			{
-			for (int j = ch3-1; j >= ch2; j--)
+			for (int64_t j = ch3-1; j >= ch2; j--)
 				{
 				if (i == st_y && j >= st_x) continue;
-				temp = matrice->m[i][j];
-				if (temp == NULL)
-					temp = "";
-				if (*str == '\0')
-					{
-					if (*temp == '\0')
-						reti = 0;
-					else
-						reti = REG_NOMATCH;
-					}
-				else
-					reti = regexec(&regex, temp, 0, NULL, 0);
+				reti = search_cell(&regex, str, get_cell(i, j), memo);
 				if (!reti)
 					{
 					y = i;
@@ -881,12 +1423,14 @@ search(const Arg *arg)
 						ch[0] = ch[1] = ch[2] = ch[3] = 0;
 						mode = 'n';
 						}
+					perf_end(PerfSearch, t0);
 					regfree(&regex);
 					return;
 					}
 				}
 			}
 		}
+	perf_end(PerfSearch, t0);
 	if (reti == REG_NOMATCH || (st_y == matrice->rows - 1 && st_x == matrice->cols - 1))
 		{
 		if (sel == 1)
@@ -905,6 +1449,22 @@ search(const Arg *arg)
 	return;
 	}
 
+int
+search_cell(regex_t *regex, char *str, char *cell, char **miss)
+	{
+	if (cell == NULL)
+		cell = "";
+	if (*str == '\0')
+		return *cell == '\0' ? 0 : REG_NOMATCH;
+	size_t i = ((uintptr_t)cell * 0x9e3779b97f4a7c15 >> 32) & (SEARCH_MEMO - 1);
+	if (miss != NULL && miss[i] == cell)
+		return REG_NOMATCH;
+	int reti = regexec(regex, cell, 0, NULL, 0);
+	if (miss != NULL && reti == REG_NOMATCH)
+		miss[i] = cell;
+	return reti;
+	}
+
 void
 move_screen_y(int n)
 	{
@@ -952,7 +1512,10 @@ statusbar(char *string)
 	mvprintw(rows - 1, 0, " ");
 	wclrtoeol(stdscr);
 	mvprintw(rows - 1, 1, "%s", string);
-	return getch();
+	damaged = 1;
+	int key = getch();
+	key_at = perf_begin();
+	return key;
 	}
 
 int
@@ -1019,12 +1582,45 @@ readall(FILE *in, char **dataptr, size_t *sizeptr)
 	return 0;
 	}
 
+size_t
+mapall(FILE *in, char **dataptr, size_t *sizeptr)
+	{
+	struct stat st;
+	char *data;
+	size_t len;
+	long page = sysconf(_SC_PAGESIZE);
+
+	/* Only regular files, pipes and empty files go through readall() */
+	if (in == NULL || fstat(fileno(in), &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0)
+		return 0;
+
+	/* Reserve one zeroed byte past the end for the terminating '\0' */
+	len = ((size_t)st.st_size / page + 1) * page;
+	data = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (data == MAP_FAILED)
+		return 0;
+	/* Private mapping, so write_to_matrix() can terminate cells in place */
+	if (mmap(data, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fileno(in), 0) == MAP_FAILED)
+		{
+		munmap(data, len);
+		return 0;
+		}
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+	madvise(data, len, MADV_HUGEPAGE);
+#endif
+
+	*dataptr = data;
+	*sizeptr = st.st_size;
+	return len;
+	}
+
 size_t
 utf8_strlen(const char *str)
 	{
 	mbstate_t state = {0};
-	const char *s = str;
-	size_t len = 0;
+	size_t len = ascii_span(str, SIZE_MAX);
+	const char *s = str + len;
 	while (*s)
 		{
 		size_t ret = mbrlen(s, MB_CUR_MAX, &state);
@@ -1036,13 +1632,39 @@ utf8_strlen(const char *str)
 	return len;
 	}
 
+size_t
+ascii_span(const char *s, size_t max)
+	{
+	/* Length of the printable ASCII run s starts with, at most max */
+	size_t n = 0;
+	while (n < max)
+		{
+		if (ascii != NULL && ((uintptr_t)(s + n) & 4095) <= 4096 - 32) /* the block stays in the page */
+			{
+			size_t k = ascii(s + n);
+			n += k;
+			if (k < 32) break;
+			}
+		else if ((unsigned char)(s[n] - 0x20) < 0x5f)
+			n++;
+		else break;
+		}
+	return n < max ? n : max;
+	}
+
+int
+wc_width(wchar_t c)
+	{
+	return c >= 0x20 && c < 0x7f ? 1 : wcwidth(c);
+	}
+
 int
 wcswidth_total(const wchar_t *wstr)
 	{
 	int total_width = 0;
 	for (size_t i = 0; wstr[i] != L'\0'; i++)
 		{
-		int width = wcwidth(wstr[i]);
+		int width = wc_width(wstr[i]);
 		if (width == -1)
 			return -1; /* invalid character */
 		total_width += width;
@@ -1058,7 +1680,7 @@ format_wide_string(wchar_t *buffer, size_t max_width)
 
 	while (buffer[i] != L'\0' && len < max_width)
 		{
-		int char_width = wcwidth(buffer[i]);
+		int char_width = wc_width(buffer[i]);
 		if (char_width < 0) char_width = 0;
 		if (len + char_width > max_width)
 			break;
@@ -1077,30 +1699,162 @@ format_wide_string(wchar_t *buffer, size_t max_width)
 void
 draw(void)
 	{
-	werase(stdscr);
-	int formatted_width = cell_width - 1;
-	if (cols < cell_width)
-		formatted_width = cols % cell_width;
-	for (int i = 0; i < scr_y; i++)
+	/* Paint what changed since the last frame, all of it after edits and prompts */
+	int64_t t0 = perf_begin();
+	int64_t dy = s_y - frame.s_y, dx = s_x - frame.s_x;
+	if (damaged || frame.scr_y != scr_y || frame.scr_x != scr_x || frame.rows != rows
+			|| frame.cols != cols || frame.layout != layout_gen
+			|| (dy != 0 && dx != 0) || llabs(dy) >= scr_y || llabs(dx) >= scr_x)
+		{
+		werase(stdscr);
+		draw_cells(0, scr_y, 0, scr_x);
+		}
+	else if (dy != 0)
+		{
+		/* The terminal moves the rows, only the ones scrolled in are converted */
+		scrollok(stdscr, TRUE);
+		wsetscrreg(stdscr, 0, scr_y - 1);
+		wscrl(stdscr, dy);
+		scrollok(stdscr, FALSE);
+		if (dy > 0)
+			draw_cells(scr_y - dy, scr_y, 0, scr_x);
+		else
+			draw_cells(0, -dy, 0, scr_x);
+		}
+	else if (dx != 0)
+		{
+		/* Copy the painted cells sideways, only the ones scrolled in are converted */
+		cchar_t cell[widest + 1];
+		int off = 0; /* where the columns were drawn, relative to now */
+		if (dx > 0)
+			for (int64_t j = s_x - dx; j < s_x; j++)
+				off += col_width(j);
+		else off = -scr_xs[-dx];
+		for (int i = 0; i < scr_y; i++)
+			{
+			for (int k = 0; k < scr_x - llabs(dx); k++)
+				{
+				int j = dx > 0 ? k : scr_x - 1 - k, n = 0, fw = text_width(j);
+				mvin_wchnstr(i, scr_xs[j] + off, cell, fw);
+				for (int w = 0; w < fw && n < fw; n++)
+					w += cchar_width(&cell[n]);
+				mvadd_wchnstr(i, scr_xs[j], cell, n);
+				}
+			}
+		if (dx > 0)
+			draw_cells(0, scr_y, scr_x - dx, scr_x);
+		else
+			draw_cells(0, scr_y, 0, -dx);
+		/* Columns of other widths leave text where the spaces between them and the tail now are */
+		for (int i = 0; i < scr_y; i++)
+			{
+			for (int j = 0; j < scr_x; j++)
+				mvaddch(i, scr_xs[j + 1] - 1, ' ');
+			if (scr_xs[scr_x] < cols)
+				{
+				move(i, scr_xs[scr_x]);
+				clrtoeol();
+				}
+			}
+		}
+	/* Cells left in place only change attribute when the selection moves */
+	for (int i = 0; i < scr_y && !damaged; i++)
 		{
 		for (int j = 0; j < scr_x; j++)
 			{
-			if (ch[0] <= s_y + i && s_y + i < ch[1] && ch[2] <= s_x + j && s_x + j < ch[3])
+			int on = selected(ch, s_y + i, s_x + j);
+			if (on != selected(frame.ch, s_y + i, s_x + j))
+				mvchgat(i, scr_xs[j], text_width(j), on ? A_STANDOUT : A_NORMAL, 0, NULL);
+			}
+		}
+	frame = (struct Frame){s_y, s_x, scr_y, scr_x, rows, cols, layout_gen, {ch[0], ch[1], ch[2], ch[3]}};
+	damaged = 0;
+	if (load != NULL)
+		{
+		mvprintw(rows - 1, 0, " Loading: %lld rows, %d%%", (long long)matrice->rows,
+				(int)(load->loaded * 100 / matrice->size));
+		wclrtoeol(stdscr);
+		}
+	wmove(stdscr, c_y, c_x);
+	perf_end(PerfDraw, t0);
+	}
+
+void
+draw_cells(int y0, int y1, int x0, int x1)
+	{
+	for (int i = y0; i < y1; i++)
+		{
+		for (int j = x0; j < x1; j++)
+			{
+			if (selected(ch, s_y + i, s_x + j))
 				attron(A_STANDOUT);
 			else attroff(A_STANDOUT);
-			char *cell_value = matrice->m[i + s_y][j + s_x];
+			char *cell_value = get_cell(i + s_y, j + s_x);
 			if (cell_value == NULL) cell_value = "";
-			wchar_t buffer[cell_width];
-			mbstowcs(buffer, cell_value, cell_width - 1);
-			buffer[cell_width - 1] = L'\0';
-			format_wide_string(buffer, formatted_width);
-			mvaddwstr(i, j * cell_width, buffer);
+			draw_cell(i, scr_xs[j], cell_value, text_width(j));
 			}
 		}
-	wmove(stdscr, c_y, c_x);
 	attroff(A_STANDOUT);
 	}
 
+int
+selected(int64_t *c, int64_t i, int64_t j)
+	{
+	return c[0] <= i && i < c[1] && c[2] <= j && j < c[3];
+	}
+
+void
+draw_cell(int y, int x, char *cell, int width)
+	{
+	/* Write the truncated and padded text of a cell, converted again only when it changed */
+	if (disp_stride != 2 * widest) /* zero width characters leave room for padding */
+		{
+		disp_stride = 2 * widest;
+		disp_text = xrealloc(disp_text, DISP_CACHE * disp_stride * sizeof(wchar_t));
+		disp_gen++;
+		}
+	size_t i = ((uintptr_t)cell * 0x9e3779b97f4a7c15 >> 32) & (DISP_CACHE - 1);
+	struct Disp *d = &disp[i];
+	wchar_t *buffer = disp_text + i * disp_stride;
+	if (d->cell != cell || d->width != width || d->gen != disp_gen)
+		{
+		/* One column per byte, no conversion needed */
+		size_t n = ascii_span(cell, width);
+		if (n == (size_t)width || cell[n] == '\0')
+			{
+			for (int k = 0; k < width; k++)
+				buffer[k] = (size_t)k < n ? (unsigned char)cell[k] : L' ';
+			buffer[width] = L'\0';
+			}
+		else
+			{
+			mbstowcs(buffer, cell, widest - 1);
+			buffer[widest - 1] = L'\0';
+			format_wide_string(buffer, width);
+			}
+		*d = (struct Disp){stable_cells() ? cell : NULL, width, disp_gen};
+		}
+	mvaddwstr(y, x, buffer);
+	}
+
+int
+stable_cells(void)
+	{
+	/* Typed columns and file blocks hand out reused buffers, other tables keep a cell at its pointer */
+	return matrice->virt == NULL && matrice->col == NULL;
+	}
+
+int
+cchar_width(cchar_t *c)
+	{
+	wchar_t wch[CCHARW_MAX + 1];
+	attr_t attrs;
+	short pair;
+	getcchar(c, wch, &attrs, &pair, NULL);
+	int w = wc_width(wch[0]);
+	return w > 0 ? w : 1;
+	}
+
 void
 move_y_visual(void)
 	{
@@ -1126,7 +1880,7 @@ move_x_visual(void)
 	}
 
 void
-move_y(int move)
+move_y(int64_t move)
 	{
 	y += move;
 	if (y >= matrice->rows)
@@ -1137,7 +1891,7 @@ move_y(int move)
 	}
 
 void
-move_x(int move)
+move_x(int64_t move)
 	{
 	x += move;
 	if (x >= matrice->cols)
@@ -1181,6 +1935,7 @@ move_y_start()
 void
 move_y_end()
 	{
+	load_wait(INT64_MAX);
 	win_scroll = 0;
 	y = matrice->rows - 1;
 	move_y_visual();
@@ -1214,15 +1969,29 @@ commands()
 
 	if (strcmp(cmd, "f") == 0)
 		{
+			if (!load_wait(INT64_MAX))
+				{
+				free(temp);
+				return;
+				}
 			if (strlen(val) == 1)
 				{
-				fs = *val;
-				statusbar("Field separator set!");
+				if (split_table(*val) == 0)
+					statusbar("Field separator set!");
 				}
 			else if (strcmp(val, "\\t") == 0)
 				{
-				fs = '\t';
-				statusbar("Field separator set to tab!");
+				if (split_table('\t') == 0)
+					statusbar("Field separator set to tab!");
+				}
+			else if (*val == '\0')
+				{
+				char msg[] = "Field separator set to ' '!";
+				if (split_table(0) == 0)
+					{
+					msg[24] = fs;
+					statusbar(fs == '\t' ? "Field separator set to tab!" : msg);
+					}
 				}
 			else
 				statusbar("Wrong field separator!");
@@ -1231,8 +2000,8 @@ commands()
 		}
 	else if ((*cmd >= '0' && *cmd <= '9') || *cmd == '.')
 		{
-		int to_num_y = 0;
-		int to_num_x = x;
+		int64_t to_num_y = 0;
+		int64_t to_num_x = x;
 		int is_number = 0;
 		char next = 0;
 
@@ -1260,23 +2029,50 @@ commands()
 			}
 		if (is_number)
 			{
-			to_num_y -= y;
-			to_num_x -= x;
-			Arg move;
-			move.i = to_num_y;
-			move_y_step(&move);
-			move.i = to_num_x;
-			move_x_step(&move);
+			load_wait(to_num_y);
+			win_scroll = 0;
+			move_y(to_num_y - y);
+			move_x(to_num_x - x);
 			}
 		else
 			statusbar("Unknown command");
 		}
+	else if (strcmp(cmd, "perf") == 0)
+		perf_show();
+	else if (strcmp(cmd, "overlay") == 0)
+		{
+		if (perf_win != NULL)
+			{
+			delwin(perf_win);
+			perf_win = NULL;
+			damaged = 1;
+			}
+		else
+			{
+			timing = 1;
+			perf_win = newwin(1, PERF_OVERLAY, 0, 0);
+			wattron(perf_win, A_STANDOUT);
+			leaveok(perf_win, TRUE);
+			}
+		}
+	else if (strcmp(cmd, "frames") == 0)
+		{
+		char msg[96];
+		snprintf(msg, sizeof(msg), "%lld keys in %lld frames, up to %d in one",
+				(long long)keys_taken, (long long)frames_drawn, keys_most);
+		statusbar(msg);
+		}
 	else if (strcmp(cmd, "q") == 0)
 		{
 		quit();
 		}
 	else if (strcmp(cmd, "w") == 0 || strcmp(cmd, "wq") == 0 || strcmp(cmd, "wr") == 0 || strcmp(cmd, "wrq") == 0)
 		{
+		if (!load_wait(INT64_MAX))
+			{
+			free(temp);
+			return;
+			}
 		int reverse = 0;
 		if (strcmp(cmd, "wr") == 0 || strcmp(cmd, "wrq") == 0)
 			reverse = 1;
@@ -1311,16 +2107,15 @@ when_resize(void)
 	{
 	curs_set(1);
 	getmaxyx(stdscr, rows, cols);
-	scr_y = rows;
-	scr_x = cols/cell_width;
-	if (scr_x == 0) scr_x = 1;
+	scr_y = rows - (load != NULL); /* keep a line for the loading status */
 	if (scr_y > matrice->rows) scr_y = matrice->rows;
-	if (scr_x > matrice->cols) scr_x = matrice->cols;
 	/* correct s_y/s_x when increasing window size to expand to whole window size */
 	if (scr_y - (matrice->rows - s_y) > 0)
 		s_y -= scr_y - (matrice->rows - s_y);
-	if (scr_x - (matrice->cols - s_x) > 0)
-		s_x -= scr_x - (matrice->cols - s_x);
+	if (matrice->cols > 0 && s_x > fit_left(matrice->cols - 1))
+		s_x = fit_left(matrice->cols - 1);
+	scr_x = fit_from(s_x);
+	if (scr_x > matrice->cols) scr_x = matrice->cols;
 	if (y < s_y) /* if y above screen */
 		{
 		if (!win_scroll) s_y = y;
@@ -1338,26 +2133,70 @@ when_resize(void)
 		}
 	else if (x >= s_x + scr_x) /* if x right of screen */
 		{
-		if (!win_scroll) s_x = x - (scr_x - 1);
+		if (!win_scroll) s_x = fit_left(x);
 		else curs_set(0);
 		}
+	scr_x = fit_from(s_x);
+	if (scr_x > matrice->cols) scr_x = matrice->cols;
+	scr_xs = xrealloc(scr_xs, (scr_x + 1) * sizeof(int));
+	scr_xs[0] = 0;
+	for (int k = 0; k < scr_x; k++)
+		scr_xs[k + 1] = scr_xs[k] + col_width(s_x + k);
 	c_y = y - s_y;
-	c_x = (x - s_x)*cell_width;
+	c_x = x >= s_x && x < s_x + scr_x ? scr_xs[x - s_x] : (x - s_x)*cell_width;
 	win_scroll = 1;
 	}
 
+int
+col_width(int64_t j)
+	{
+	return j < n_col_w ? col_w[j] : cell_width;
+	}
+
+int
+fit_from(int64_t j)
+	{
+	/* Columns from j on that fit on the screen, at least one */
+	int n = 0, w = 0;
+	while (j + n < matrice->cols && (w += col_width(j + n)) <= cols)
+		n++;
+	return n > 0 ? n : 1;
+	}
+
+int64_t
+fit_left(int64_t j)
+	{
+	/* First column of a screen that ends with column j */
+	int w = col_width(j);
+	while (j > 0 && (w += col_width(j - 1)) <= cols)
+		j--;
+	return j;
+	}
+
+int
+text_width(int k)
+	{
+	/* Room for the text of the k-th column on screen, one wider than the screen gets all of it */
+	int w = scr_xs[k + 1] - scr_xs[k];
+	return w > cols ? cols : w - 1;
+	}
+
+void
+layout_changed(void)
+	{
+	layout_gen++;
+	widest = cell_width;
+	for (int64_t j = 0; j < n_col_w; j++)
+		if (col_w[j] > widest) widest = col_w[j];
+	}
+
 void
 insert_row(const Arg *arg)
 	{
+	if (!load_wait(INT64_MAX)) return;
 	if (mode == 'v') visual_end();
 	y += arg->i;
-	matrice->m = xrealloc(matrice->m, (matrice->rows + 1) * sizeof(char *));
-	for (int i = matrice->rows; i > y; i--)
-		matrice->m[i] = matrice->m[i - 1];
-	matrice->m[y] = xmalloc(matrice->cols * sizeof(char *));
-	for (int j = 0; j < matrice->cols; j++)
-		matrice->m[y][j] = NULL;
-	matrice->rows++;
+	rows_insert(y, 1);
 	struct undo data[] = {{Insert, NULL, NULL, 1, 0, y, x, s_y, s_x, y, x}};
 	push(&uhead, data, 1);
 	}
@@ -1365,16 +2204,10 @@ insert_row(const Arg *arg)
 void
 insert_col(const Arg *arg)
 	{
+	if (!load_wait(INT64_MAX)) return;
 	if (mode == 'v') visual_end();
 	x += arg->i;
-	for (int i = 0; i < matrice->rows; i++)
-		{
-		matrice->m[i] = xrealloc(matrice->m[i], (matrice->cols + 1) * sizeof(char *));
-		for (int j = matrice->cols; j > x; j--)
-			matrice->m[i][j] = matrice->m[i][j - 1];
-		matrice->m[i][x] = NULL;
-		}
-	matrice->cols++;
+	cols_insert(x, 1);
 	struct undo data[] = {{Insert, NULL, NULL, 0, 1, y, x, s_y, s_x, y, x}};
 	push(&uhead, data, 1);
 	}
@@ -1385,20 +2218,18 @@ delete_row()
 	reg_init();
 	char ***undo_mat = xmalloc(reg->rows * sizeof(char **));
 	char *current_ptr = reg->buff;
-	for (int i = ch[0]; i < ch[1]; i++)
+	for (int64_t i = ch[0]; i < ch[1]; i++)
 		{
-		undo_mat[i - ch[0]] = matrice->m[i];
-		for (int j = ch[2]; j < ch[3]; j++)
+		undo_mat[i - ch[0]] = xmalloc(reg->cols * sizeof(char *));
+		for (int64_t j = ch[2]; j < ch[3]; j++)
 			{
-			if (matrice->m[i][j] == NULL) matrice->m[i][j] = "";
-			strcpy(current_ptr, matrice->m[i][j]);
-			reg->m[i - ch[0]][j - ch[2]] = current_ptr;
-			current_ptr += strlen(matrice->m[i][j]) + 1;
+			char *temp = take_cell(i, j);
+			undo_mat[i - ch[0]][j - ch[2]] = temp;
+			if (temp == NULL) temp = "";
+			reg->m[i - ch[0]][j - ch[2]] = reg_str(&current_ptr, temp);
 			}
 		}
-	for (int i = ch[0]; i < matrice->rows - reg->rows; i++)
-		matrice->m[i] = matrice->m[i + reg->rows];
-	matrice->rows -= reg->rows;
+	rows_cut(ch[0], reg->rows);
 	struct undo data[] = {
 		{Delete, undo_mat, NULL, reg->rows, reg->cols, y_0, x_0, s_y, s_x, ch[0], ch[2]},
 		{Cut, NULL, NULL, reg->rows, 0, ch[0], x, s_y, s_x, ch[0], x},
@@ -1408,15 +2239,13 @@ delete_row()
 		{
 		data[1].rows--;
 		data[2] = (struct undo){Cut, NULL, NULL, 0, reg->cols-1, 0, 0, 0, 0, 0, 0};
-		matrice->rows = matrice->cols = 1;
+		cols_cut(1, matrice->cols - 1);
+		rows_insert(0, 1);
 		x = 0;
-		matrice->m[0] = xmalloc(sizeof(char *));
-		matrice->m[0][0] = NULL;
 		push(&uhead, data, 3);
 		}
 	else
 		push(&uhead, data, 2);
-	matrice->m = xrealloc(matrice->m, matrice->rows * sizeof(char **));
 	y = ch[0];
 	if (y >= matrice->rows)
 		y = ch[0] - 1;
@@ -1430,24 +2259,20 @@ delete_col()
 	{
 	reg_init();
 	char ***undo_mat = xmalloc(reg->rows * sizeof(char**));
-	for (int i = 0; i < reg->rows; i++)
+	for (int64_t i = 0; i < reg->rows; i++)
 		undo_mat[i] = xmalloc(reg->cols * sizeof(char*));
 	char *current_ptr = reg->buff;
-	for (int i = ch[0]; i < ch[1]; i++)
+	for (int64_t i = ch[0]; i < ch[1]; i++)
 		{
-		for (int j = ch[2]; j < ch[3]; j++)
+		for (int64_t j = ch[2]; j < ch[3]; j++)
 			{
-			undo_mat[i - ch[0]][j - ch[2]] = matrice->m[i][j];
-			if (matrice->m[i][j] == NULL) matrice->m[i][j] = "";
-			strcpy(current_ptr, matrice->m[i][j]);
-			reg->m[i - ch[0]][j - ch[2]] = current_ptr;
-			current_ptr += strlen(matrice->m[i][j]) + 1;
-			matrice->m[i][j] = NULL;
+			char *temp = take_cell(i, j);
+			undo_mat[i - ch[0]][j - ch[2]] = temp;
+			if (temp == NULL) temp = "";
+			reg->m[i - ch[0]][j - ch[2]] = reg_str(&current_ptr, temp);
 			}
-		for (int j = ch[2]; j < matrice->cols - reg->cols; j++)
-			matrice->m[i][j] = matrice->m[i][j + reg->cols];
 		}
-	matrice->cols -= reg->cols;
+	cols_cut(ch[2], reg->cols);
 	struct undo data[] = {
 		{Delete, undo_mat, NULL, reg->rows, reg->cols, y_0, x_0, s_y, s_x, ch[0], ch[2]},
 		{Cut, NULL, NULL, 0, reg->cols, y, ch[2], s_y, s_x, y, ch[2]},
@@ -1457,10 +2282,9 @@ delete_col()
 		{
 		data[1].cols--;
 		data[2] = (struct undo){Cut, NULL, NULL, reg->rows-1, 0, 0, 0, 0, 0, 0, 0};
-		matrice->rows = matrice->cols = 1;
+		rows_cut(1, matrice->rows - 1);
+		cols_insert(0, 1);
 		y = 0;
-		matrice->m[0] = xmalloc(sizeof(char *));
-		matrice->m[0][0] = NULL;
 		push(&uhead, data, 3);
 		}
 	else
@@ -1511,7 +2335,7 @@ get_str(char *str, char loc, const char cmd)
 	int hidden_text = 0;
 	int line_widths_size = 8;
 	int *line_widths = xmalloc(line_widths_size * sizeof(int));
-	int s_y0x = s_y;
+	int64_t s_y0x = s_y;
 
 	while (1)
 		{
@@ -1523,7 +2347,7 @@ get_str(char *str, char loc, const char cmd)
 		cx_add = 0, cy_add = 0;
 		for (size_t j = 0; j < i; j++)
 			{
-			int width = wcwidth(buffer[j]);
+			int width = wc_width(buffer[j]);
 			if (width == -1)
 				{
 				statusbar("Invalid character encountered.");
@@ -1579,7 +2403,8 @@ get_str(char *str, char loc, const char cmd)
 		else hidden_text = 0;
 
 		draw();
-		mvprintw(c_y, c_x, "%*s", cell_width, "");
+		damaged = 1; /* the line being edited goes over the cells */
+		mvprintw(c_y, c_x, "%*s", col_width(x), "");
 		if (cmd != 0)
 			mvaddch(c_y, 0, cmd);
 		if (cmd == '|' || cmd == '<' || cmd == '>')
@@ -1644,6 +2469,7 @@ get_str(char *str, char loc, const char cmd)
 
 		wint_t key;
 		int ret = get_wch(&key);
+		key_at = perf_begin(); /* time the key that ends the prompt, not the typing */
 		if (ret == OK)
 			{
 			if (key == '\n')
@@ -1812,6 +2638,7 @@ visual()
 	if (key == 'l' || key == 'h' || key == '$' || key == '0' ||
 			key == 'w' || key == 'b' || key == KEY_RIGHT || key == KEY_LEFT)
 		{
+		if (!load_wait(INT64_MAX)) return;
 		mode = 'n';
 		visual_start();
 		all_flag = 2;
@@ -1854,6 +2681,7 @@ visual()
 void
 write_to_fifo(const Arg *arg)
 	{
+	if (!load_wait(INT64_MAX)) return;
 	int reverse = 0;
 
 	if (!pipe_created)
@@ -1931,10 +2759,44 @@ write_csv(char **name, int reverse, int fifo)
 		m_time = st.st_mtime;
 		}
 
-	FILE *file = fopen(filename, "w");
+	/* Cells may still be read from the mapped file, so write beside it and rename.
+	 * A symlink is followed, the file it points to is the one replaced. */
+	int64_t t0 = perf_begin();
+	char *tmpname = NULL, *real = NULL;
+	struct stat st;
+	if (matrice->mapsize && stat(filename, &st) == 0 && st.st_dev == matrice->dev && st.st_ino == matrice->ino)
+		{
+		/* Never in place: -v still reads rows from the file long after opening it */
+		if ((real = realpath(filename, NULL)) == NULL)
+			{
+			statusbar("Can not write over the opened file in place");
+			return -1;
+			}
+		tmpname = xmalloc(strlen(real) + 8);
+		sprintf(tmpname, "%s.csvis~", real);
+		}
+	FILE *file = fopen(tmpname != NULL ? tmpname : filename, "w");
 	if (!file)
 		{
 		statusbar("Error opening file for writing");
+		free(tmpname);
+		free(real);
+		return -1;
+		}
+	if (tmpname != NULL && fchown(fileno(file), st.st_uid, st.st_gid) != 0)
+		fchown(fileno(file), -1, st.st_gid); /* keep the group at least, if it is one of ours */
+	if (tmpname != NULL)
+		fchmod(fileno(file), st.st_mode & 07777);
+	/* Compress when the name has the extension of a known program */
+	FILE *disk = file;
+	pid_t pid = 0;
+	struct Codec *codec = fifo == 0 ? codec_ext(filename) : NULL;
+	if (codec != NULL && (file = codec_open(disk, codec, 1, &pid)) == NULL)
+		{
+		fclose(disk);
+		statusbar("Error opening file for writing");
+		free(tmpname);
+		free(real);
 		return -1;
 		}
 
@@ -1947,7 +2809,7 @@ write_csv(char **name, int reverse, int fifo)
 		}
 	if (reverse == 1) 
 		{
-		int temp1, temp2;
+		int64_t temp1, temp2;
 		temp1 = ch[0];
 		temp2 = ch[1];
 		ch[0] = ch[2];
@@ -1958,23 +2820,24 @@ write_csv(char **name, int reverse, int fifo)
 	char *first = "";
 	char *end = "";
 	char fs1 = fs;
+	char *nl = eol;
 	if (fifo == 1)
-		{ first = "=["; end = "]"; fs1 = ',';}
-	for (int i = ch[0]; i < ch[1]; i++)
+		{ first = "=["; end = "]"; fs1 = ','; nl = "\n"; }
+	for (int64_t i = ch[0]; i < ch[1]; i++)
 		{
-		for (int j = ch[2]; j < ch[3]; j++)
+		for (int64_t j = ch[2]; j < ch[3]; j++)
 			{
 			char *inverse = NULL;
 			if (reverse == 1)
-				inverse = matrice->m[j][i];
+				inverse = get_cell(j, i);
 			else
-				inverse = matrice->m[i][j];
+				inverse = get_cell(i, j);
 			if (inverse != NULL) fprintf(file, "%s", inverse);
 			if (j == ch[3]-1)
 				{
 				if (*end != '\0' && j != ch[2])
 					fprintf(file, "%s", end);
-				fprintf(file, "\n");
+				fprintf(file, "%s", nl);
 				}
 			else if (j == ch[2] && *first != '\0')
 				fprintf(file, "%s", first);
@@ -1982,20 +2845,53 @@ write_csv(char **name, int reverse, int fifo)
 				fprintf(file, "%c", fs1);
 			}
 		}
-	fclose(file);
+	int ret = fclose(file);
+	if (pid > 0)
+		{
+		int status;
+		waitpid(pid, &status, 0);
+		fclose(disk);
+		if (ret != 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			{
+			if (tmpname != NULL)
+				unlink(tmpname);
+			free(tmpname);
+			free(real);
+			statusbar("Error compressing file");
+			return -1;
+			}
+		}
+	if (tmpname != NULL)
+		{
+		ret = rename(tmpname, real);
+		free(tmpname);
+		free(real);
+		if (ret != 0)
+			{
+			statusbar("Error opening file for writing");
+			return -1;
+			}
+		}
+	if (fifo == 0) /* between edits, so a good time to drop dead strings */
+		arena_compact();
+	perf_end(PerfWrite, t0);
 	return 0;
 	}
 
 void
 write_to_cells(char *buffer, int arg)
 	{
-	int cols, rows;
+	int64_t cols, rows;
 	char *inverse = NULL;;
 	char ***temp = write_to_matrix(&buffer, &rows, &cols);
-	if (temp == NULL) return;
+	if (temp == NULL)
+		{
+		free(buffer);
+		return;
+		}
 	if (arg == PipeReadInverse)
 		{
-		int temp_rows = rows;
+		int64_t temp_rows = rows;
 		rows = cols;
 		cols = temp_rows;
 		}
@@ -2003,13 +2899,12 @@ write_to_cells(char *buffer, int arg)
 	if (mode == 'v' || (arg != PipeRead && arg != PipeReadInverse && arg != PipeReadClip && mode == 'n') )
 		{
 		undo_mat0 = xmalloc((ch[1] - ch[0]) * sizeof(char **));
-		for (int i = 0; i < (ch[1] - ch[0]); i++)
+		for (int64_t i = 0; i < (ch[1] - ch[0]); i++)
 			{
 			undo_mat0[i] = xmalloc((ch[3] - ch[2]) * sizeof(char *));
-			for (int j = 0; j < (ch[3] - ch[2]); j++)
+			for (int64_t j = 0; j < (ch[3] - ch[2]); j++)
 				{
-				undo_mat0[i][j] = matrice->m[ch[0] + i][ch[2] + j];
-				matrice->m[ch[0] + i][ch[2] + j] = NULL;
+				undo_mat0[i][j] = take_cell(ch[0] + i, ch[2] + j);
 				}
 			}
 		}
@@ -2023,43 +2918,24 @@ write_to_cells(char *buffer, int arg)
 		}
 	char ***paste_mat = xmalloc(rows * sizeof(char **));
 	char ***undo_mat = xmalloc(rows * sizeof(char **));
-	int add_y, add_x = 0;
+	int64_t add_y, add_x = 0;
 	if ((add_y = ch[0] + rows - matrice->rows) < 0) add_y = 0;
-	if (add_y > 0) /* If not enough rows */
-		{
-		matrice->m = xrealloc(matrice->m, (matrice->rows + add_y) * sizeof(char **));
-		for (int i = matrice->rows; i < matrice->rows + add_y; i++)
-			{
-			matrice->m[i] = xmalloc(matrice->cols * sizeof(char *));
-			for (int j = 0; j < matrice->cols; j++)
-				matrice->m[i][j] = NULL;
-			}
-		matrice->rows += add_y;
-		}
+	rows_insert(matrice->rows, add_y); /* If not enough rows */
 	if ((add_x = ch[2] + cols - matrice->cols) < 0) add_x = 0;
-	if (add_x > 0) /* If not enough cols */
-		{
-		for (int i = 0; i < matrice->rows; i++)
-			{
-			matrice->m[i] = xrealloc(matrice->m[i], (matrice->cols + add_x) * sizeof(char *));
-			for (int j = matrice->cols; j < matrice->cols + add_x; j++)
-				matrice->m[i][j] = NULL;
-			}
-		matrice->cols += add_x;
-		}
-	for (int i = 0; i < rows; i++)
+	cols_insert(matrice->cols, add_x); /* If not enough cols */
+	for (int64_t i = 0; i < rows; i++)
 		{
 		undo_mat[i] = xmalloc(cols * sizeof(char *));
 		paste_mat[i] = xmalloc(cols * sizeof(char *));
-		for (int j = 0; j < cols; j++)
+		for (int64_t j = 0; j < cols; j++)
 			{
 			if (arg == PipeReadInverse) inverse = temp[j][i];
 			else inverse = temp[i][j];
 			if (inverse != NULL)
 				{
-				undo_mat[i][j] = matrice->m[ch[0] + i][ch[2] + j];
-				paste_mat[i][j] = inverse;
-				matrice->m[ch[0] + i][ch[2] + j] = inverse;
+				undo_mat[i][j] = take_cell(ch[0] + i, ch[2] + j);
+				paste_mat[i][j] = arena_str(inverse);
+				set_cell(ch[0] + i, ch[2] + j, paste_mat[i][j]);
 				}
 			else
 				{
@@ -2072,23 +2948,25 @@ write_to_cells(char *buffer, int arg)
 		{Delete, undo_mat0, NULL, ch[1] - ch[0], ch[3] - ch[2], y_0, x_0, s_y0, s_x0, ch[0], ch[2]},
 		{Delete, undo_mat, NULL, rows, cols, y_0, x_0, s_y0, s_x0, ch[0], ch[2]},
 		{Insert, NULL, NULL, add_y, add_x, y_0, x_0, s_y0, s_x0, matrice->rows-add_y, matrice->cols-add_x},
-		{Paste, paste_mat, buffer, rows, cols, y_0, x_0, s_y0, s_x0, ch[0], ch[2]}
+		{Paste, paste_mat, NULL, rows, cols, y_0, x_0, s_y0, s_x0, ch[0], ch[2]}
 	};
 	push(&uhead, data, 4);
 	if (arg == PipeReadInverse)
 		{
-		int temp_rows = rows;
+		int64_t temp_rows = rows;
 		rows = cols;
 		cols = temp_rows;
 		}
-	for (int i = 0; i < rows; i++) free(temp[i]);
+	for (int64_t i = 0; i < rows; i++) free(temp[i]);
 	free(temp);
+	free(buffer);
 	}
 
 int
 pipe_through(char **output_buffer, ssize_t *output_buffer_size, char *cmd)
 	{
 	int pin[2], pout[2], perr[2], status = -1;
+	int64_t t0 = perf_begin();
 	
 	if (pipe(pin) == -1)
 		return -1;
@@ -2148,13 +3026,14 @@ pipe_through(char **output_buffer, ssize_t *output_buffer_size, char *cmd)
 	char buffer[PIPE_BUF];
 	ssize_t nread, nwritten;
 	size_t buffer_len = 0;
-	int row = ch[0], col = ch[2];
+	int64_t row = ch[0], col = ch[2];
 	size_t pos = 0, pos_str = 0;
 	ssize_t buffer_capacity = 0;
 	char buferror[4096];
 	size_t poserror = 0;
 	int attempts = 0;
 	const int max_attempts = 4000;
+	int exited = 0;
 
 	while (pin[1] != -1 || pout[0] != -1 || perr[0] != -1)
 		{
@@ -2167,7 +3046,7 @@ pipe_through(char **output_buffer, ssize_t *output_buffer_size, char *cmd)
 					{
 					for (; col < ch[3]; col++)
 						{
-						char *temp = matrice->m[row][col];
+						char *temp = get_cell(row, col);
 						if (temp == NULL) temp = "";
 						size_t len = strlen(temp) - pos_str;
 						if (pos + len >= PIPE_BUF)
@@ -2215,9 +3094,9 @@ pipe_through(char **output_buffer, ssize_t *output_buffer_size, char *cmd)
 			{
 			char buf[PIPE_BUF];
 			nread = read(pout[0], buf, sizeof(buf));
-			if (*output_buffer_size + nread + 1 > buffer_capacity)
+			if (*output_buffer_size + PIPE_BUF + 1 > buffer_capacity)
 				{
-				buffer_capacity = buffer_capacity ? buffer_capacity * 2 : (nread * 2) + 1;
+				buffer_capacity = buffer_capacity ? buffer_capacity * 2 : PIPE_BUF * 2;
 				char *newp = realloc(*output_buffer, buffer_capacity);
 				if (newp == NULL)
 					{
@@ -2243,11 +3122,16 @@ pipe_through(char **output_buffer, ssize_t *output_buffer_size, char *cmd)
 				}
 			else if (errno == EAGAIN)
 				{
-				if (waitpid(pid, NULL, WNOHANG) == pid)
+				/* Whatever it wrote before exiting is read first */
+				if (exited)
 					{
+					*(*output_buffer + *output_buffer_size) = '\0';
+					(*output_buffer_size)++;
 					close(pout[0]);
 					pout[0] = -1;
 					}
+				else if (waitpid(pid, NULL, WNOHANG) == pid)
+					exited = 1;
 				}
 			else if (errno != EINTR && errno != EWOULDBLOCK)
 				{
@@ -2291,6 +3175,7 @@ pipe_through(char **output_buffer, ssize_t *output_buffer_size, char *cmd)
 		}
 
 	waitpid(pid, &status, 0);
+	perf_end(PerfPipe, t0);
 
 	if (WIFEXITED(status) && WEXITSTATUS(status) != 0)
 		{
@@ -2303,6 +3188,7 @@ pipe_through(char **output_buffer, ssize_t *output_buffer_size, char *cmd)
 void
 write_to_pipe(const Arg *arg)
 	{
+	if (!load_wait(INT64_MAX)) return;
 	char *cmd;
 	if (arg->i == PipeThrough)
 		{
@@ -2364,6 +3250,7 @@ write_to_pipe(const Arg *arg)
 			{
 			werase(stdscr);
 			mvprintw(0, 0, "%s", output_buffer);
+			damaged = 1;
 			getch();
 			}
 		else
@@ -2391,38 +3278,44 @@ reg_init(void)
 	reg->rows = ch[1] - ch[0];
 	reg->cols = ch[3] - ch[2];
 	reg->size = 0;
-	for (int i = ch[0]; i < ch[1]; i++)
+	for (int64_t i = ch[0]; i < ch[1]; i++)
 		{
-		for (int j = ch[2]; j < ch[3]; j++)
+		for (int64_t j = ch[2]; j < ch[3]; j++)
 			{
-			if (matrice->m[i][j] != NULL)
-				reg->size += strlen(matrice->m[i][j]) + 1;
+			char *temp = get_cell(i, j);
+			if (temp != NULL)
+				reg->size += strlen(temp) + 1;
 			else
 				reg->size += 1;
 			}
 		}
 	reg->buff = xmalloc(reg->size * sizeof(char));
 	reg->m = xmalloc(reg->rows * sizeof(char **));
-	for (int i = 0; i < reg->rows; i++)
+	for (int64_t i = 0; i < reg->rows; i++)
 		reg->m[i] = xmalloc(reg->cols * sizeof(char *));
 	}
 
+char *
+reg_str(char **pos, char *s)
+	{
+	/* Copies live in the register's buffer, with -i too, and go when it is replaced */
+	char *cell = strcpy(*pos, s);
+	*pos += strlen(s) + 1;
+	return cell;
+	}
+
 void
 yank_cells()
 	{
 	reg_init();
 	char *current_ptr = reg->buff;
-	for (int i = ch[0]; i < ch[1]; i++)
+	for (int64_t i = ch[0]; i < ch[1]; i++)
 		{
-		for (int j = ch[2]; j < ch[3]; j++)
+		for (int64_t j = ch[2]; j < ch[3]; j++)
 			{
-			char *temp = matrice->m[i][j];
+			char *temp = get_cell(i, j);
 			if (temp != NULL)
-				{
-				strcpy(current_ptr, matrice->m[i][j]);
-				reg->m[i - ch[0]][j - ch[2]] = current_ptr;
-				current_ptr += strlen(matrice->m[i][j]) + 1;
-				}
+				reg->m[i - ch[0]][j - ch[2]] = reg_str(&current_ptr, temp);
 			else reg->m[i - ch[0]][j - ch[2]] = NULL;
 			}
 		}
@@ -2438,22 +3331,18 @@ wipe_cells()
 	reg_init();
 
 	char ***undo_mat = xmalloc(reg->rows * sizeof(char **));
-	for (int i=0; i<reg->rows; i++)
+	for (int64_t i=0; i<reg->rows; i++)
 		undo_mat[i] = xmalloc(reg->cols * sizeof(char *));
 	char *current_ptr = reg->buff;
-	for (int i = ch[0]; i < ch[1]; i++)
+	for (int64_t i = ch[0]; i < ch[1]; i++)
 		{
-		for (int j = ch[2]; j < ch[3]; j++)
+		for (int64_t j = ch[2]; j < ch[3]; j++)
 			{
-			undo_mat[i-ch[0]][j-ch[2]] = matrice->m[i][j];
-			if (matrice->m[i][j] != NULL)
-				{
-				strcpy(current_ptr, matrice->m[i][j]);
-				reg->m[i - ch[0]][j - ch[2]] = current_ptr;
-				current_ptr += strlen(matrice->m[i][j]) + 1;
-				}
+			char *temp = take_cell(i, j);
+			undo_mat[i-ch[0]][j-ch[2]] = temp;
+			if (temp != NULL)
+				reg->m[i - ch[0]][j - ch[2]] = reg_str(&current_ptr, temp);
 			else reg->m[i - ch[0]][j - ch[2]] = NULL;
-			matrice->m[i][j] = NULL;
 			}
 		}
 	struct undo data[] = {{Delete, undo_mat, NULL, reg->rows, reg->cols, y_0, x_0, s_y0, s_x0, ch[0], ch[2]}};
@@ -2468,19 +3357,14 @@ wipe_cells()
 void
 paste_cells(const Arg *arg)
 	{
+	if (!load_wait(INT64_MAX)) return;
 	y_0 = y; x_0 = x;
-	int loc_y = matrice->rows;
-	int loc_x = matrice->cols;
-	int add_y, add_x = 0;
-	char *buffer = NULL;
+	int64_t loc_y = matrice->rows;
+	int64_t loc_x = matrice->cols;
+	int64_t add_y, add_x = 0;
 	if (reg == NULL) return;
-	else
-		{
-		buffer = xmalloc(reg->size * sizeof(char));
-		memcpy(buffer, reg->buff, reg->size);
-		}
-	int rows = reg->rows;
-	int cols = reg->cols;
+	int64_t rows = reg->rows;
+	int64_t cols = reg->cols;
 	if (arg->i == PasteInverse)
 		{
 		rows = reg->cols;
@@ -2505,66 +3389,33 @@ paste_cells(const Arg *arg)
 	if ((add_y = y + rows - matrice->rows) < 0) add_y = 0;
 	if (paste_flag == 3 && arg->i == PasteNormal) add_y = rows;
 	if (paste_flag == 4 && arg->i == PasteInverse) add_y = rows;
-	if (add_y > 0) /* If not enough rows */
-		{
-		matrice->m = xrealloc(matrice->m, (matrice->rows + add_y) * sizeof(char **));
-		for (int i = matrice->rows + add_y - 1; i >= loc_y + add_y; i--)
-			matrice->m[i] = matrice->m[i - add_y];
-		for (int i = 0; i < add_y; i++)
-			{
-			matrice->m[loc_y + i] = xmalloc(matrice->cols * sizeof(char *));
-			for (int j = 0; j < matrice->cols; j++)
-				matrice->m[loc_y + i][j] = NULL;
-			}
-		matrice->rows += add_y;
-		}
+	rows_insert(loc_y, add_y); /* If not enough rows */
 	if ((add_x = x + cols - matrice->cols) < 0) add_x = 0;
 	if (paste_flag == 4 && arg->i == PasteNormal) add_x = cols;
 	if (paste_flag == 3 && arg->i == PasteInverse) add_x = cols;
-	if (add_x > 0) /* If not enough cols */
-		{
-		for (int i = 0; i < matrice->rows; i++)
-			{
-			matrice->m[i] = xrealloc(matrice->m[i], (matrice->cols + add_x) * sizeof(char *));
-			for (int j = matrice->cols + add_x - 1; j >= loc_x + add_x; j--)
-				matrice->m[i][j] = matrice->m[i][j - add_x];
-			for (int j = 0; j < add_x; j++)
-				matrice->m[i][loc_x + j] = NULL;
-			}
-		matrice->cols += add_x;
-		}
+	cols_insert(loc_x, add_x); /* If not enough cols */
 	char ***undo_mat = xmalloc(rows * sizeof(char **));
 	char ***paste_mat = xmalloc(rows * sizeof(char **));
-	for (int i=0; i<rows; i++)
+	for (int64_t i=0; i<rows; i++)
 		{
 		undo_mat[i] = xmalloc(cols * sizeof(char *));
 		paste_mat[i] = xmalloc(cols * sizeof(char *));
 		}
-	char *current_ptr = buffer;
-	for (int i = 0; i < rows; i++)
+	for (int64_t i = 0; i < rows; i++)
 		{
-		for (int j = 0; j < cols; j++)
+		for (int64_t j = 0; j < cols; j++)
 			{
-			undo_mat[i][j] = matrice->m[y + i][x + j];
+			undo_mat[i][j] = take_cell(y + i, x + j);
 			char *inverse = (arg->i == PasteInverse) ? reg->m[j][i] : reg->m[i][j];
+			paste_mat[i][j] = arena_str(inverse);
 			if (inverse != NULL)
-				{
-				strcpy(current_ptr, inverse);
-				paste_mat[i][j] = current_ptr;
-				matrice->m[y + i][x + j] = current_ptr;
-				current_ptr += strlen(inverse) + 1;
-				}
-			else
-				{
-				paste_mat[i][j] = NULL;
-				matrice->m[y + i][x + j] = NULL;
-				}
+				set_cell(y + i, x + j, paste_mat[i][j]);
 			}
 		}
 	struct undo data[] = {
 		{Insert, NULL, NULL, add_y, add_x, y_0, x_0, s_y, s_x, loc_y, loc_x},
 		{Delete, undo_mat, NULL, rows, cols, y_0, x_0, s_y, s_x, y, x},
-		{Paste, paste_mat, buffer, rows, cols, y_0, x_0, s_y, s_x, y, x}
+		{Paste, paste_mat, NULL, rows, cols, y_0, x_0, s_y, s_x, y, x}
 	};
 	push(&uhead, data, 3);
 	x = x_0;
@@ -2574,6 +3425,7 @@ paste_cells(const Arg *arg)
 void
 deleting()
 	{
+	if (!load_wait(INT64_MAX)) return;
 	if (mode == 'v')
 		{
 		if (ch[2] == 0 && ch[3] == matrice->cols && ch[0] == 0 && ch[1] == matrice->rows)
@@ -2706,6 +3558,7 @@ deleting()
 void
 wiping()
 	{
+	if (!load_wait(INT64_MAX)) return;
 	if (mode == 'v')
 		{
 		wipe_cells();
@@ -2789,6 +3642,7 @@ yanking()
 			}
 		else if (key == 'G')
 			{
+			if (!load_wait(INT64_MAX)) return;
 			ch[0] = y;
 			ch[1] = matrice->rows;
 			ch[2] = x;
@@ -2810,6 +3664,7 @@ yanking()
 void
 str_change(const Arg *arg)
 	{
+	if (!load_wait(INT64_MAX)) return;
 	if (mode == 'v') visual_end();
 	mode = 'i';
 	char *str;
@@ -2818,34 +3673,26 @@ str_change(const Arg *arg)
 		{
 		if (y == matrice->rows)
 			{
-			matrice->rows++;
-			matrice->m = xrealloc(matrice->m, matrice->rows * sizeof(char **));
-			matrice->m[y] = xmalloc(matrice->cols * sizeof(char *));
-			for (int j = 0; j < matrice->cols; j++)
-				matrice->m[y][j] = NULL;
+			rows_insert(y, 1);
 			rows = 1;
 			cols = 0;
 			}
 		else if (x == matrice->cols)
 			{
-			matrice->cols++;
-			for (int i = 0; i < matrice->rows; i++)
-				{
-				matrice->m[i] = xrealloc(matrice->m[i], matrice->cols * sizeof(char *));
-				matrice->m[i][x] = NULL;
-				}
+			cols_insert(x, 1);
 			cols = 1;
 			rows = 0;
 			}
 		if (arg->i == 0)
 			str = get_str("", 0, 0);
 		else if (arg->i == 1)
-			str = get_str(matrice->m[y][x], 0, 0);
+			str = get_str(get_cell(y, x), 0, 0);
 		else if (arg->i == 2)
-			str = get_str(matrice->m[y][x], 1, 0);
-		char *undo_cell = matrice->m[y][x];
-		char *paste_cell = str;
-		matrice->m[y][x] = str;
+			str = get_str(get_cell(y, x), 1, 0);
+		char *undo_cell = take_cell(y, x);
+		char *paste_cell = arena_str(str);
+		free(str);
+		set_cell(y, x, paste_cell);
 
 		struct undo data[] = {
 			{Insert, NULL, NULL, rows, cols, y, x, s_y, s_x, y, x},
@@ -2879,11 +3726,6 @@ push(node_t **uhead, struct undo *data, int dc)
 			{
 			if (temp->data[i].mat != NULL)
 				free_matrix(&(temp->data[i].mat), temp->data[i].rows);
-			if (temp->data[i].cell != NULL)
-				{
-				if (temp->data[i].operation == PasteCell || temp->data[i].operation == Paste)
-					free(temp->data[i].cell);
-				}
 			}
 		free(temp->data);
 		(*uhead)->next = temp->next;
@@ -2919,82 +3761,41 @@ undo(const Arg *arg)
 				}
 			if (op == Delete)
 				{
-				for (int i = 0; i < uhead->data[l].rows; i++)
+				for (int64_t i = 0; i < uhead->data[l].rows; i++)
 					{
-					for (int j = 0; j < uhead->data[l].cols; j++)
+					for (int64_t j = 0; j < uhead->data[l].cols; j++)
 						{
 						if (uhead->data[l].mat[i][j] != NULL)
-							matrice->m[uhead->data[l].loc_y + i][uhead->data[l].loc_x + j] = NULL;
+							set_cell(uhead->data[l].loc_y + i, uhead->data[l].loc_x + j, NULL);
 						}
 					}
 				}
 			else if (op == Paste)
 				{
-				for (int i = 0; i < uhead->data[l].rows; i++)
+				for (int64_t i = 0; i < uhead->data[l].rows; i++)
 					{
-					for (int j = 0; j < uhead->data[l].cols; j++)
+					for (int64_t j = 0; j < uhead->data[l].cols; j++)
 						{
 						if (uhead->data[l].mat[i][j] != NULL)
-							matrice->m[uhead->data[l].loc_y + i][uhead->data[l].loc_x + j] = uhead->data[l].mat[i][j];
+							set_cell(uhead->data[l].loc_y + i, uhead->data[l].loc_x + j, uhead->data[l].mat[i][j]);
 						}
 					}
 				}
 			else if (op == PasteCell)
-				matrice->m[uhead->data[l].loc_y][uhead->data[l].loc_x] = uhead->data[l].cell;
+				set_cell(uhead->data[l].loc_y, uhead->data[l].loc_x, uhead->data[l].cell);
 			else if (op == DeleteCell)
-				matrice->m[uhead->data[l].loc_y][uhead->data[l].loc_x] = NULL;
+				set_cell(uhead->data[l].loc_y, uhead->data[l].loc_x, NULL);
+			else if (op == Separator) /* old separator in loc_y, new in loc_x */
+				fs = arg->i == Undo ? uhead->data[l].loc_y : uhead->data[l].loc_x;
 			else if (op == Cut)
 				{
-				if (uhead->data[l].rows > 0)
-					{
-					int num = uhead->data[l].rows;
-					for (int i = 0; i < num; i++) {
-						free(matrice->m[uhead->data[l].loc_y + i]);
-					}
-					for (int i = uhead->data[l].loc_y; i < matrice->rows - num; i++)
-						matrice->m[i] = matrice->m[i + num];
-					matrice->m = xrealloc(matrice->m, (matrice->rows - num) * sizeof(char **));
-					matrice->rows -= num;
-					}
-				if (uhead->data[l].cols > 0)
-					{
-					int num = uhead->data[l].cols;
-					for (int j = 0; j < matrice->rows; j++)
-						{
-						for (int i = uhead->data[l].loc_x; i < matrice->cols - num; i++)
-							matrice->m[j][i] = matrice->m[j][i + num];
-						matrice->m[j] = xrealloc(matrice->m[j], (matrice->cols - num) * sizeof(char *));
-						}
-					matrice->cols -= num;
-					}
+				rows_cut(uhead->data[l].loc_y, uhead->data[l].rows);
+				cols_cut(uhead->data[l].loc_x, uhead->data[l].cols);
 				}
 			else if (op == Insert)
 				{
-				if (uhead->data[l].cols > 0)
-					{
-					for (int i = 0; i < matrice->rows; i++)
-						{
-						matrice->m[i] = xrealloc(matrice->m[i], (matrice->cols + uhead->data[l].cols) * sizeof(char *));
-						for (int j = matrice->cols + uhead->data[l].cols - 1; j >= uhead->data[l].loc_x + uhead->data[l].cols; j--)
-							matrice->m[i][j] = matrice->m[i][j - uhead->data[l].cols];
-						for (int j = 0; j < uhead->data[l].cols; j++)
-							matrice->m[i][uhead->data[l].loc_x + j] = NULL;
-						}
-					matrice->cols += uhead->data[l].cols;
-					}
-				if (uhead->data[l].rows > 0)
-					{
-					matrice->m = xrealloc(matrice->m, (matrice->rows + uhead->data[l].rows) * sizeof(char **));
-					for (int i = matrice->rows + uhead->data[l].rows - 1; i >= uhead->data[l].loc_y + uhead->data[l].rows; i--)
-						matrice->m[i] = matrice->m[i - uhead->data[l].rows];
-					for (int i = 0; i < uhead->data[l].rows; i++)
-						{
-						matrice->m[uhead->data[l].loc_y + i] = xmalloc(matrice->cols * sizeof(char *));
-						for (int j = 0; j < matrice->cols; j++)
-							matrice->m[uhead->data[l].loc_y + i][j] = NULL;
-						}
-					matrice->rows += uhead->data[l].rows;
-					}
+				cols_insert(uhead->data[l].loc_x, uhead->data[l].cols);
+				rows_insert(uhead->data[l].loc_y, uhead->data[l].rows);
 				}
 			if (uhead->data[l].y == matrice->rows)
 				y = uhead->data[l].y - 1;
@@ -3015,6 +3816,8 @@ void
 die(void)
 	{
 	endwin();
+	load_stop();
+	follow_stop();
 	if (uhead)
 		{
 		while (uhead->next != NULL)
@@ -3029,11 +3832,6 @@ die(void)
 					{
 					free_matrix(&(uhead->data[i].mat), uhead->data[i].rows);
 					}
-				if (uhead->data[i].cell != NULL)
-					{
-					if (uhead->data[i].operation == PasteCell || uhead->data[i].operation == Paste)
-						free(uhead->data[i].cell);
-					}
 				}
 			free(uhead->data);
 			uhead = uhead->prev;
@@ -3041,8 +3839,31 @@ die(void)
 			}
 			free(uhead);
 		}
-	free_matrix(&matrice->m, matrice->rows);
-	free(matrice->buff);
+	if (matrice->virt != NULL)
+		virt_free();
+	else if (matrice->col != NULL)
+		col_free();
+	else if (matrice->pack != NULL)
+		pack_free();
+	else if (matrice->sparse != NULL)
+		sparse_free();
+	else
+		{
+		gap_move(matrice->rows);
+		free_matrix(&matrice->m, matrice->rows);
+		dense_free();
+		}
+	if (matrice->mapsize)
+		munmap(matrice->buff, matrice->mapsize);
+	else
+		free(matrice->buff);
+	for (int i = 0; i < matrice->n_texts; i++)
+		free(matrice->texts[i]);
+	free(matrice->texts);
+	for (int64_t i = 0; i < matrice->arena.n; i++)
+		free(matrice->arena.slab[i].buff);
+	free(matrice->arena.slab);
+	free(matrice->arena.set);
 	free(matrice);
 	if (reg)
 		{
@@ -3051,6 +3872,10 @@ die(void)
 		free(reg);
 		}
 	free(fname);
+	free(disp_text);
+	fit_free();
+	free(col_w);
+	free(scr_xs);
 	if (open(FIFO, O_WRONLY | O_NONBLOCK) == -1)
 		unlink(FIFO);
 	printf("\033]0;\a");
@@ -3110,192 +3935,3595 @@ keypress(int key)
 		return 0;
 	}
 
-char ***
-write_to_matrix(char **buffer, int *n_rows, int *n_cols)
+int
+take_keys(int key)
 	{
-	int row = 0, col = 0;
-	int col_s = 32, row_s = 32;
-	size_t n = 0;
-	int cols_max = 0;
-
-	char ***matrix = xmalloc(row_s * sizeof(char **));
-	matrix[row] = xmalloc(col_s * sizeof(char *));
-	char *k = *buffer;
-	char *start = k;
-	int in_quotes = 0;
-	while (*k)
+	/* Handle everything typed before drawing once, and no sooner than FRAME_MS after the last frame */
+	key_at = perf_begin();
+	int redraw = keypress(key), n = 1;
+	while (1)
 		{
+		int64_t wait = frame_ms + FRAME_MS - now_ms();
+		timeout(redraw && wait > 0 ? wait : 0);
+		key = getch();
+		timeout(-1);
+		if (key == ERR)
+			break;
+		when_resize(); /* keys see the screen as if it was drawn after each */
+		redraw |= keypress(key);
 		n++;
-		if (*k == fs && !in_quotes)
-			{
-			if (col >= col_s)
-				{
-				col_s *= 2;
-				matrix[row] = xrealloc(matrix[row], col_s * sizeof(char *));
-				}
-			*k = '\0'; 
-			matrix[row][col] = start;
-			n = 0;
-			col++;
-			start = k + 1;
-			}
-		else if (*k == '\n')
+		}
+	keys_taken += n;
+	if (n > keys_most) keys_most = n;
+	if (!redraw)
+		key_at = 0; /* nothing to paint, a later frame is not this key's */
+	return redraw;
+	}
+
+int64_t
+now_ms(void)
+	{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (int64_t)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+	}
+
+int64_t
+now_us(void)
+	{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (int64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+	}
+
+int64_t
+perf_begin(void)
+	{
+	return timing ? now_us() : 0;
+	}
+
+void
+perf_end(int op, int64_t t0)
+	{
+	if (!timing || t0 == 0) return;
+	struct Perf *p = &perf[op];
+	int64_t us = now_us() - t0;
+	p->n++;
+	p->last = us;
+	if (us > p->max) p->max = us;
+	p->hist[perf_bucket(us)]++;
+	}
+
+int
+perf_bucket(int64_t us)
+	{
+	/* Exact below 4, then the power of two and the next two bits */
+	if (us < 4) return us;
+	int e = 63 - __builtin_clzll(us);
+	return 4 * (e - 1) + ((us >> (e - 2)) & 3);
+	}
+
+int64_t
+perf_floor(int b)
+	{
+	if (b < 4) return b;
+	return (int64_t)(4 + b % 4) << (b / 4 - 1);
+	}
+
+int64_t
+perf_share(struct Perf *p, int percent)
+	{
+	/* The time percent of the samples stayed under, to a quarter of a power of two */
+	uint64_t sum = 0;
+	for (int b = 0; b < PERF_BUCKETS; b++)
+		if ((sum += p->hist[b]) * 100 >= p->n * percent)
+			return perf_floor(b) < p->max ? perf_floor(b) : p->max;
+	return p->max;
+	}
+
+void
+perf_show(void)
+	{
+	if (!timing)
+		{
+		timing = 1;
+		statusbar("Timing from now on, :perf again for the numbers");
+		return;
+		}
+	werase(stdscr);
+	mvprintw(0, 0, "%-14s%10s%12s%12s%12s", "operation", "count", "p50 ms", "p99 ms", "max ms");
+	for (int i = 0; i < PerfOps; i++)
+		mvprintw(i + 1, 0, "%-14s%10llu%12.3f%12.3f%12.3f", perf_name[i], (unsigned long long)perf[i].n,
+				perf_share(&perf[i], 50) / 1e3, perf_share(&perf[i], 99) / 1e3, perf[i].max / 1e3);
+	damaged = 1;
+	getch();
+	}
+
+void
+perf_paint(void)
+	{
+	/* Put the frame on the terminal now to time it from the key, the overlay goes over it */
+	wnoutrefresh(stdscr);
+	doupdate();
+	perf_end(PerfKey, key_at);
+	key_at = 0;
+	if (perf_win == NULL) return;
+	mvwin(perf_win, 0, cols > PERF_OVERLAY ? cols - PERF_OVERLAY : 0);
+	werase(perf_win);
+	mvwprintw(perf_win, 0, 0, " draw %.3fms key %.3fms", perf[PerfDraw].last / 1e3, perf[PerfKey].last / 1e3);
+	touchwin(perf_win);
+	wnoutrefresh(perf_win);
+	doupdate();
+	}
+
+void
+field_end(struct Parse *p, char *k)
+	{
+	if (p->col >= p->col_s)
+		{
+		p->col_s *= 2;
+		p->cells = xrealloc(p->cells, p->col_s * sizeof(char *));
+		}
+	*k = '\0';
+	p->cells[p->col] = p->start;
+	p->col++;
+	p->start = k + 1;
+	}
+
+void
+row_add(struct Parse *p)
+	{
+	/* Rows get the widest width so far, only earlier ones are widened at the end */
+	if (p->col > p->cols_max)
+		p->cols_max = p->col;
+	char **row = xmalloc(p->cols_max * sizeof(char *));
+	memcpy(row, p->cells, p->col * sizeof(char *));
+	for (int64_t j = p->col; j < p->cols_max; j++)
+		row[j] = NULL;
+	if (p->row >= p->row_s)
+		{
+		p->row_s *= 2;
+		p->matrix = xrealloc(p->matrix, p->row_s * sizeof(char **));
+		p->widths = xrealloc(p->widths, p->row_s * sizeof(int64_t));
+		}
+	p->matrix[p->row] = row;
+	p->widths[p->row] = p->cols_max;
+	p->row++;
+	p->col = 0;
+	}
+
+void
+row_end(struct Parse *p, char *k)
+	{
+	field_end(p, k);
+	row_add(p);
+	}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2"))) void
+classify_sse2(const char *k, uint64_t *mask)
+	{
+	const char c[4] = {fs, '\n', '"', '\r'};
+	__m128i v[4];
+	for (int j = 0; j < 4; j++)
+		v[j] = _mm_loadu_si128((const __m128i *)(k + 16*j));
+	for (int i = 0; i < 4; i++)
+		{
+		__m128i s = _mm_set1_epi8(c[i]);
+		mask[i] = 0;
+		for (int j = 0; j < 4; j++)
+			mask[i] |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v[j], s)) << 16*j;
+		}
+	}
+
+__attribute__((target("avx2"))) void
+classify_avx2(const char *k, uint64_t *mask)
+	{
+	const char c[4] = {fs, '\n', '"', '\r'};
+	__m256i lo = _mm256_loadu_si256((const __m256i *)k);
+	__m256i hi = _mm256_loadu_si256((const __m256i *)(k + 32));
+	for (int i = 0; i < 4; i++)
+		{
+		__m256i s = _mm256_set1_epi8(c[i]);
+		uint32_t l = _mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, s));
+		uint32_t h = _mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, s));
+		mask[i] = (uint64_t)h << 32 | l;
+		}
+	}
+
+__attribute__((target("sse2"), no_sanitize_address)) size_t
+ascii_sse2(const char *k)
+	{
+	/* Printable bytes at the start of a 32 byte block, it may run past the string */
+	__m128i lo = _mm_set1_epi8(0x1f), hi = _mm_set1_epi8(0x7f);
+	uint64_t m = 0;
+	for (int j = 0; j < 2; j++)
+		{
+		__m128i v = _mm_loadu_si128((const __m128i *)(k + 16*j));
+		__m128i in = _mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi));
+		m |= (uint64_t)(uint16_t)_mm_movemask_epi8(in) << 16*j;
+		}
+	return __builtin_ctzll(~m);
+	}
+
+__attribute__((target("avx2"), no_sanitize_address)) size_t
+ascii_avx2(const char *k)
+	{
+	__m256i v = _mm256_loadu_si256((const __m256i *)k);
+	__m256i in = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(0x1f)),
+			_mm256_cmpgt_epi8(_mm256_set1_epi8(0x7f), v));
+	return __builtin_ctzll(~(uint64_t)(uint32_t)_mm256_movemask_epi8(in));
+	}
+#endif
+
+void
+classify_init(void)
+	{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		{ classify = classify_avx2; ascii = ascii_avx2; }
+	else if (__builtin_cpu_supports("sse2"))
+		{ classify = classify_sse2; ascii = ascii_sse2; }
+#endif
+	}
+
+uint64_t
+prefix_xor(uint64_t m)
+	{
+	m ^= m << 1;
+	m ^= m << 2;
+	m ^= m << 4;
+	m ^= m << 8;
+	m ^= m << 16;
+	m ^= m << 32;
+	return m;
+	}
+
+void *
+parse_chunk(void *arg)
+	{
+	struct Parse *p = arg;
+	p->row = p->col = p->cols_max = 0;
+	p->row_s = p->col_s = 32;
+	p->matrix = xmalloc(p->row_s * sizeof(char **));
+	p->widths = xmalloc(p->row_s * sizeof(int64_t));
+	p->cells = xmalloc(p->col_s * sizeof(char *));
+	char *k = p->begin;
+	char *end = p->end;
+	p->start = k;
+	int in_quotes = p->quoted;
+	/* The vector path can not tell these apart from the other special bytes */
+	int simd = classify != NULL && fs != '\n' && fs != '"' && fs != '\r';
+	while (k < end)
+		{
+		if (simd && end - k >= 64)
 			{
-			*k = '\0';
-			matrix[row][col] = start;
-			n = 0;
-			col++;
-			if (col > cols_max) /* If row more columns than previous add cols to rows before */
-				{
-				for (int i = 0; i < row; i++)
-					{
-					matrix[i] = xrealloc(matrix[i], col * sizeof(char *));
-					for (int j = cols_max; j < col; j++)
-						matrix[i][j] = NULL;
-					}
-				cols_max = col;
-				}
-			while (col < cols_max) /* If row less columns than previous add cols to n_cols */
-				matrix[row][col++] = NULL;
-			col = 0;
-			matrix[row] = xrealloc(matrix[row], cols_max * sizeof(char *));
-			row++;
-			if (row >= row_s)
+			uint64_t mask[4];
+			classify(k, mask);
+			/* Quote state after every byte, carried over from the previous block */
+			uint64_t quoted = prefix_xor(mask[2]) ^ -(uint64_t)in_quotes;
+			in_quotes = quoted >> 63;
+			uint64_t bits = (mask[0] & ~quoted) | mask[1] | mask[3];
+			while (bits)
 				{
-				row_s *= 2;
-				matrix = xrealloc(matrix, row_s * sizeof(char **));
+				char *c = k + __builtin_ctzll(bits);
+				bits &= bits - 1;
+				if (*c == '\n') row_end(p, c);
+				else if (*c == '\r') *c = '\0';
+				else field_end(p, c);
 				}
-			start = k + 1;
-			matrix[row] = xmalloc(col_s * sizeof(char *));
+			k += 64;
+			continue;
 			}
+		if (*k == fs && !in_quotes) field_end(p, k);
+		else if (*k == '\n') row_end(p, k);
 		else if (*k == '"') { in_quotes = !in_quotes; }
 		else if (*k == '\r') *k = '\0';
 		k++;
 		}
+	p->parity = in_quotes ^ p->quoted;
 
-	if (n == 0 && col == 0) free(matrix[row]);
-	else
+	/* Chunks other than the last end on a newline and take this branch */
+	size_t n = k - p->start;
+	if (n)
 		{
-		if (n)
-			{ matrix[row][col] = start; col++; }
-		if (col > cols_max)
-			{
-			for (int i = 0; i < row; i++)
-				{
-				matrix[i] = xrealloc(matrix[i], col * sizeof(char *));
-				for (int j = cols_max; j < col; j++)
-					matrix[i][j] = NULL;
-				}
-			cols_max = col;
-			}
-		while (col < cols_max)
-			matrix[row][col++] = NULL;
-		row++;
+		if (p->col >= p->col_s)
+			p->cells = xrealloc(p->cells, (p->col + 1) * sizeof(char *));
+		p->cells[p->col] = p->start;
+		p->col++;
 		}
+	if (p->col > 0)
+		row_add(p);
 
-	*n_rows = row;
-	*n_cols = cols_max;
-
-	if (*n_rows == 0 || *n_cols == 0) return NULL;
-	matrix = xrealloc(matrix, *n_rows * sizeof(char **));
-
-	return matrix;
+	/* Each row is widened at most once, so ragged text stays linear */
+	for (int64_t i = 0; i < p->row; i++)
+		{
+		if (p->widths[i] == p->cols_max)
+			continue;
+		p->matrix[i] = xrealloc(p->matrix[i], p->cols_max * sizeof(char *));
+		for (int64_t j = p->widths[i]; j < p->cols_max; j++)
+			p->matrix[i][j] = NULL;
+		}
+	free(p->widths);
+	free(p->cells);
+	return NULL;
 	}
 
 void
-free_matrix(char ****matrix, int n_rows)
+unparse_chunk(struct Parse *p)
 	{
-	for (int i = 0; i < n_rows; i++)
-		free((*matrix)[i]);
-	free(*matrix);
+	/* Cells after the first were split off at a separator, rows at a newline */
+	for (int64_t i = 0; i < p->row; i++)
+		{
+		for (int64_t j = 1; j < p->cols_max && p->matrix[i][j] != NULL; j++)
+			p->matrix[i][j][-1] = fs;
+		if (i > 0)
+			p->matrix[i][0][-1] = '\n';
+		free(p->matrix[i]);
+		}
+	if (p->row > 0 && p->start == p->end)
+		p->end[-1] = '\n';
+	free(p->matrix);
 	}
 
-void
-init_ui(void)
+void *
+reparse_chunk(void *arg)
 	{
-	setlocale(LC_ALL, "");
-	initscr();
-	cbreak();
-	raw();
-	noecho();
-	keypad(stdscr, TRUE);
-	mousemask(BUTTON1_PRESSED | BUTTON4_PRESSED | BUTTON5_PRESSED, NULL);
-	mouseinterval(0);
+	struct Parse *p = arg;
+	if (p->redo)
+		{
+		unparse_chunk(p);
+		parse_chunk(p);
+		}
+	return NULL;
+	}
+
+void *
+pad_chunk(void *arg)
+	{
+	struct Parse *p = arg;
+	if (p->cols_max == p->width)
+		return NULL;
+	for (int64_t i = 0; i < p->row; i++)
+		{
+		p->matrix[i] = xrealloc(p->matrix[i], p->width * sizeof(char *));
+		for (int64_t j = p->cols_max; j < p->width; j++)
+			p->matrix[i][j] = NULL;
+		}
+	return NULL;
 	}
 
 void
-usage(void)
+parallel(void *(*func)(void *), void *args, size_t size, int n)
 	{
-	fprintf(stderr, "Uporaba: %s [-f separator] [file]\n", argv0);
-	exit(EXIT_FAILURE);
+	pthread_t tid[n];
+	int started[n];
+	for (int i = 0; i < n; i++)
+		started[i] = n > 1 && pthread_create(&tid[i], NULL, func, (char *)args + i*size) == 0;
+	for (int i = 0; i < n; i++)
+		{
+		if (started[i])
+			pthread_join(tid[i], NULL);
+		else /* run it here if no thread could be spawned */
+			func((char *)args + i*size);
+		}
 	}
 
-int
-main(int argc, char *argv[])
+char ***
+parse_range(char *begin, char *end, int *quoted, int64_t *n_rows, int64_t *n_cols)
 	{
-	FILE *file = NULL;
-	char *val = NULL;
-	ARGBEGIN
+	char *k = begin;
+	size_t len = end - begin;
+	int n = jobs;
+	if ((size_t)n > len / PARSE_CHUNK) n = len / PARSE_CHUNK;
+	/* A separator that is also a quote or newline makes rows depend on quote state */
+	if (n < 1 || fs == '"' || fs == '\n') n = 1;
+
+	/* Split on newlines, which end a row whatever the quote state */
+	struct Parse p[n];
+	for (int i = 0; i < n; i++)
 		{
-		case 'f':
-			val = EARGF(usage());
-			if (strlen(val) == 1)
-				fs = val[0];
-			else if (strcmp(val, "\\t") == 0)
-				fs = '\t';
-			else
-				usage();
-			break;
-		default:
-			usage();
+		char *cut = begin + len/n*(i + 1);
+		char *nl = NULL;
+		if (cut < k) cut = k;
+		if (i < n - 1)
+			nl = memchr(cut, '\n', end - cut);
+		p[i].begin = k;
+		p[i].end = k = nl != NULL ? nl + 1 : end;
+		p[i].quoted = i == 0 ? *quoted : 0;
 		}
-	ARGEND;
-	if (argc > 0)
+
+	/* Speculate that every later chunk starts outside quotes, then redo the ones that do not */
+	parallel(parse_chunk, p, sizeof(*p), n);
+	int redo = 0;
+	for (int i = 0; i < n; i++)
 		{
-		fname = strdup(argv[0]);
-		if (fname == NULL) exit(EXIT_FAILURE);
-		printf("\033]0;%s - csvis\a", fname);
-		fflush(stdout);
-		file = fopen(fname, "r");
+		p[i].redo = p[i].quoted != *quoted;
+		p[i].quoted = *quoted;
+		redo |= p[i].redo;
+		*quoted ^= p[i].parity;
 		}
-	else
+	if (redo)
+		parallel(reparse_chunk, p, sizeof(*p), n);
+
+	int64_t rows = 0, cols_max = 0;
+	for (int i = 0; i < n; i++)
 		{
-		fname = NULL;
-		printf("\033]0;[No name] - csvis\a");
-		fflush(stdout);
+		rows += p[i].row;
+		if (p[i].cols_max > cols_max)
+			cols_max = p[i].cols_max;
 		}
-	matrice = malloc(sizeof(struct Mat));
-	if (matrice == NULL)
+	for (int i = 0; i < n; i++)
+		p[i].width = cols_max;
+	parallel(pad_chunk, p, sizeof(*p), n);
+
+	*n_rows = rows;
+	*n_cols = cols_max;
+
+	if (*n_rows == 0 || *n_cols == 0)
 		{
-		free(fname);
-		exit(EXIT_FAILURE);
+		for (int i = 0; i < n; i++)
+			free(p[i].matrix);
+		return NULL;
 		}
-	readall(file, &matrice->buff, &matrice->size);
-	matrice->m = write_to_matrix(&matrice->buff, &matrice->rows, &matrice->cols);
-	uhead = xmalloc(sizeof(node_t));
-	uhead->next = NULL;
-	uhead->prev = NULL;
+	char ***matrix = p[0].matrix;
+	if (n > 1)
+		{
+		matrix = xmalloc(rows * sizeof(char **));
+		for (int64_t i = 0, row = 0; i < n; row += p[i++].row)
+			{
+			memcpy(matrix + row, p[i].matrix, p[i].row * sizeof(char **));
+			free(p[i].matrix);
+			}
+		}
+	else
+		matrix = xrealloc(matrix, rows * sizeof(char **));
 
-	if (file != NULL)
-		fclose(file);
+	return matrix;
+	}
 
-	struct stat st;
-	if (stat(fname, &st) != 0)
-		return -1;
-	m_time = st.st_mtime;
+char ***
+write_to_matrix(char **buffer, int64_t *n_rows, int64_t *n_cols)
+	{
+	int quoted = 0;
+	int64_t t0 = perf_begin();
+	char ***m = parse_range(*buffer, *buffer + strlen(*buffer), &quoted, n_rows, n_cols);
+	perf_end(PerfParse, t0);
+	return m;
+	}
 
-	init_ui();
-	int key;
-	int redraw = 1;
+void
+keep_text(char *text)
+	{
+	matrice->texts = xrealloc(matrice->texts, (matrice->n_texts + 1) * sizeof(char *));
+	matrice->texts[matrice->n_texts++] = text;
+	}
 
-	while (1)
+void *
+join_chunk(void *arg)
+	{
+	struct Join *p = arg;
+	char *k = p->out;
+	size_t len = 0;
+	for (int64_t i = p->begin; i < p->end; i++)
 		{
-		if (redraw == 1)
+		/* Padding past the last cell was not in the text */
+		int64_t n = p->cols;
+		while (n > 0 && p->m[i][n - 1] == NULL)
+			n--;
+		for (int64_t j = 0; j < n; j++)
 			{
-			when_resize();
-			draw();
+			char *cell = p->m[i][j] != NULL ? p->m[i][j] : "";
+			size_t l = strlen(cell);
+			if (k != NULL)
+				{
+				memcpy(k, cell, l);
+				k += l;
+				*k++ = j < n - 1 ? p->fs : '\n';
+				}
+			len += l + 1;
 			}
-		key = getch();
-		redraw = keypress(key);
+		if (n == 0 && k != NULL)
+			*k++ = '\n';
+		if (n == 0)
+			len++;
+		}
+	p->len = len;
+	return NULL;
+	}
+
+int
+sniff_lines(char *begin, char *end, char sep, int quoting, int *count)
+	{
+	/* Separators on each line, the same way parse_chunk() splits it */
+	int lines = 0, n = 0, quoted = 0;
+	for (char *k = begin; k < end; k++)
+		{
+		if (*k == '"' && quoting) quoted = !quoted;
+		else if (*k == sep && !quoted) n++;
+		else if (*k == '\n')
+			{
+			count[lines++] = n;
+			n = 0;
+			}
+		}
+	/* Windows are cut at a newline, only the end of the text can be in a line */
+	if (end > begin && end[-1] != '\n')
+		count[lines++] = n;
+	return lines;
+	}
+
+int
+sniff_cmp(const void *a, const void *b)
+	{
+	return *(const int *)a - *(const int *)b;
+	}
+
+void
+sniff(char *begin, char *end, struct Dialect *d)
+	{
+	/* The start of the text and a few windows further in, so big files cost the same */
+	char *from[SNIFF_STRIDES + 1], *to[SNIFF_STRIDES + 1];
+	size_t len = end - begin;
+	int n = 0;
+	size_t bytes = 0;
+	for (int i = 0; i <= SNIFF_STRIDES; i++)
+		{
+		char *a = begin + len / (SNIFF_STRIDES + 1) * i;
+		if (i > 0 && (a < begin + SNIFF_BYTES || (a = memchr(a, '\n', end - a)) == NULL))
+			continue;
+		if (i > 0) a++;
+		char *b = a + (i == 0 ? SNIFF_BYTES : SNIFF_STRIDE);
+		if (b > end) b = end;
+		/* Only whole lines, except the last one of the text */
+		while (b < end && b > a && b[-1] != '\n')
+			b--;
+		from[n] = a;
+		to[n++] = b;
+		bytes += b - a + 1;
+		}
+
+	int *count = xmalloc(bytes * sizeof(int));
+	int best_score = 0, best_cells = 0;
+	d->fs = 0;
+	for (char *c = ",;\t|"; *c; c++)
+		{
+		/* Quotes only count when fields start with them */
+		int quoting = 0;
+		for (int w = 0; w < n && !quoting; w++)
+			{
+			char *k = from[w];
+			quoting = k < to[w] && *k == '"';
+			for (; k < to[w] - 1 && !quoting; k++)
+				quoting = (*k == *c || *k == '\n') && k[1] == '"';
+			}
+		int lines = 0;
+		for (int w = 0; w < n; w++)
+			lines += sniff_lines(from[w], to[w], *c, quoting, count + lines);
+		qsort(count, lines, sizeof(int), sniff_cmp);
+		/* Score by the most common number of separators per line */
+		for (int i = 0, run; i < lines; i += run)
+			{
+			for (run = 1; i + run < lines && count[i + run] == count[i]; run++);
+			if (count[i] > 0 && (run > best_score || (run == best_score && count[i] > best_cells)))
+				{
+				d->fs = *c;
+				best_score = run;
+				best_cells = count[i];
+				}
+			}
+		}
+	free(count);
+
+	int lines = 0, crlf = 0;
+	for (int w = 0; w < n; w++)
+		for (char *k = from[w]; k < to[w]; k++)
+			if (*k == '\n')
+				{
+				lines++;
+				crlf += k > from[w] && k[-1] == '\r';
+				}
+	d->crlf = lines > 0 && crlf * 2 > lines;
+	}
+
+void
+detect_dialect(char *begin, char *end)
+	{
+	if (!detect) return;
+	detect = 0;
+	struct Dialect d;
+	sniff(begin, end, &d);
+	if (d.fs != 0)
+		fs = d.fs;
+	eol = d.crlf ? "\r\n" : "\n";
+	}
+
+int
+split_table(char sep)
+	{
+	if (matrice->virt != NULL)
+		{
+		/* The index has to be rebuilt, which the undo history can not follow */
+		if (uhead->prev != NULL || uhead->next != NULL)
+			{
+			statusbar("Write the table before changing the separator");
+			return -1;
+			}
+		struct Dialect d;
+		if (sep == 0)
+			{
+			sniff(matrice->buff, matrice->buff + matrice->size, &d);
+			sep = d.fs;
+			}
+		if (sep == 0)
+			{
+			statusbar("No field separator found");
+			return -1;
+			}
+		if (sep == fs)
+			return 0;
+		char old = fs;
+		virt_free();
+		fs = sep;
+		if (!virt_open())
+			{
+			fs = old;
+			virt_open();
+			}
+		y = x = s_y = s_x = 0;
+		if (autofit)
+			fit_start();
+		return 0;
+		}
+
+	/* Join the rows back into text with the old separator */
+	char *base = matrice->pack != NULL ? matrice->pack->base : matrice->buff;
+	size_t size = matrice->pack != NULL ? matrice->pack->size : matrice->size;
+	col_rows();
+	dense_flat();
+	int64_t rows = matrice->rows, cols = matrice->cols;
+	if (rows == 0)
+		{
+		sparse_build();
+		if (columnar) col_build();
+		pack_build(base, size);
+		return 0;
+		}
+	int n = jobs;
+	if (n > rows / JOIN_ROWS) n = rows / JOIN_ROWS;
+	if (n < 1) n = 1;
+	struct Join p[n];
+	for (int i = 0; i < n; i++)
+		p[i] = (struct Join){matrice->m, (int64_t)rows * i / n, (int64_t)rows * (i + 1) / n, cols, fs, NULL, 0};
+	parallel(join_chunk, p, sizeof(*p), n);
+	size_t len = 0;
+	for (int i = 0; i < n; i++)
+		len += p[i].len;
+	char *text = xmalloc(len + 1);
+	for (int i = 0, off = 0; i < n; off += p[i++].len)
+		p[i].out = text + off;
+	parallel(join_chunk, p, sizeof(*p), n);
+	text[len] = '\0';
+
+	struct Dialect d;
+	if (sep == 0)
+		{
+		sniff(text, text + len, &d);
+		sep = d.fs;
+		}
+	if (sep == 0 || sep == fs)
+		{
+		free(text);
+		sparse_build();
+		if (columnar) col_build();
+		pack_build(base, size);
+		if (sep != 0)
+			return 0;
+		statusbar("No field separator found");
+		return -1;
+		}
+	char old = fs;
+	fs = sep;
+	int quoted = 0;
+	int64_t new_rows, new_cols;
+	char ***m = parse_range(text, text + len, &quoted, &new_rows, &new_cols);
+	keep_text(text);
+
+	/* One undo entry swaps the whole table */
+	char ***undo_mat = xmalloc(new_rows * sizeof(char **));
+	for (int64_t i = 0; i < new_rows; i++)
+		{
+		undo_mat[i] = xmalloc(new_cols * sizeof(char *));
+		memcpy(undo_mat[i], m[i], new_cols * sizeof(char *));
+		}
+	struct undo data[] = {
+		{Delete, matrice->m, NULL, rows, cols, y, x, s_y, s_x, 0, 0},
+		{Cut, NULL, NULL, rows, cols, y, x, s_y, s_x, 0, 0},
+		{Insert, NULL, NULL, new_rows, new_cols, y, x, s_y, s_x, 0, 0},
+		{Paste, undo_mat, NULL, new_rows, new_cols, y, x, s_y, s_x, 0, 0},
+		{Separator, NULL, NULL, 0, 0, y, x, s_y, s_x, old, sep},
+	};
+	push(&uhead, data, 5);
+	damaged = 1;
+	disp_gen++;
+	matrice->m = m;
+	matrice->gap_len = 0;
+	matrice->rows = new_rows;
+	matrice->cols = new_cols;
+	sparse_build();
+	if (columnar) col_build();
+	else if (interning) intern_table();
+	pack_build(text, len + 1);
+	if (autofit)
+		fit_start();
+	if (y >= new_rows) y = new_rows - 1;
+	if (x >= new_cols) x = new_cols - 1;
+	if (y < 0) y = 0;
+	if (x < 0) x = 0;
+	return 0;
+	}
+
+char *
+slice_end(char *pos, char *end, size_t len)
+	{
+	char *nl = NULL;
+	if ((size_t)(end - pos) > len)
+		nl = memchr(pos + len, '\n', end - pos - len);
+	if (nl != NULL)
+		end = nl + 1;
+	/* Like strlen() in write_to_matrix(), stop at the first NUL */
+	nl = memchr(pos, '\0', end - pos);
+	return nl != NULL ? nl : end;
+	}
+
+void *
+load_thread(void *arg)
+	{
+	struct Load *l = arg;
+	size_t len = LOAD_CHUNK;
+	char *pos = l->pos;
+	while (*pos != '\0')
+		{
+		int64_t rows, cols;
+		char *end = slice_end(pos, l->end, len);
+		char ***m = NULL;
+		struct Virt t = {.rows = 0};
+		if (l->virt)
+			{
+			virt_scan(&t, pos, end, &l->quoted);
+			rows = t.rows;
+			cols = t.cols;
+			}
+		else
+			m = parse_range(pos, end, &l->quoted, &rows, &cols);
+		if (!l->virt && cols < l->cols)
+			{
+			struct Parse p = {.matrix = m, .row = rows, .cols_max = cols, .width = l->cols};
+			pad_chunk(&p);
+			cols = l->cols;
+			}
+
+		pthread_mutex_lock(&l->lock);
+		if (!l->virt && cols > l->cols)
+			{
+			struct Parse p = {.matrix = l->m, .row = l->rows, .cols_max = l->cols, .width = cols};
+			pad_chunk(&p);
+			}
+		if (cols > l->cols)
+			l->cols = cols;
+		if (l->virt)
+			{
+			l->index = xrealloc(l->index, (l->n + t.n) * sizeof(struct Index));
+			for (int64_t j = 0; j < t.n; j++)
+				{
+				t.index[j].row += l->rows;
+				l->index[l->n++] = t.index[j];
+				}
+			}
+		else
+			{
+			l->m = xrealloc(l->m, (l->rows + rows) * sizeof(char **));
+			memcpy(l->m + l->rows, m, rows * sizeof(char **));
+			}
+		l->rows += rows;
+		l->pos = pos = end;
+		int stop = l->stop;
+		pthread_mutex_unlock(&l->lock);
+		free(m);
+		free(t.index);
+
+		if (stop) break;
+		if (len < (size_t)PARSE_CHUNK * jobs) len *= 2;
+		}
+	pthread_mutex_lock(&l->lock);
+	l->finished = 1;
+	pthread_mutex_unlock(&l->lock);
+	return NULL;
+	}
+
+void
+load_start(void)
+	{
+	char *end = matrice->buff + matrice->size;
+	char *pos = slice_end(matrice->buff, end, LOAD_CHUNK);
+	int quoted = 0;
+	/* Parse the first screenfuls here, the rest in the background */
+	matrice->m = parse_range(matrice->buff, pos, &quoted, &matrice->rows, &matrice->cols);
+	/* With -p the batches are packed as they come, never all of them as pointers at once */
+	if (!columnar)
+		pack_build(matrice->buff, matrice->size);
+	if (*pos != '\0')
+		load_run(pos, quoted, 0);
+	}
+
+void
+load_run(char *pos, int quoted, int virt)
+	{
+	load = xmalloc(sizeof(struct Load));
+	*load = (struct Load){.pos = pos, .end = matrice->buff + matrice->size, .quoted = quoted, .cols = matrice->cols, .virt = virt};
+	pthread_mutex_init(&load->lock, NULL);
+	if (pthread_create(&load->tid, NULL, load_thread, load) != 0)
+		{
+		load->tid = pthread_self();
+		load_thread(load);
+		}
+	}
+
+int
+load_rows(void)
+	{
+	if (load == NULL) return 0;
+	pthread_mutex_lock(&load->lock);
+	char ***m = load->m;
+	struct Index *index = load->index;
+	int64_t k = load->n;
+	int64_t n = load->rows;
+	int64_t cols = load->cols;
+	int finished = load->finished;
+	char *pos = load->pos;
+	load->loaded = pos - matrice->buff;
+	load->m = NULL;
+	load->index = NULL;
+	load->n = 0;
+	load->rows = 0;
+	pthread_mutex_unlock(&load->lock);
+
+	if (matrice->virt != NULL)
+		virt_grow(index, k, n, cols, pos);
+	else
+		append_rows(m, n, cols);
+
+	if (finished)
+		{
+		load_stop();
+		madvise(matrice->buff, matrice->size, MADV_NORMAL);
+		if (matrice->virt != NULL) index_save(matrice->virt);
+		else if (columnar) col_build();
+		else if (interning) intern_table();
+		pack_build(matrice->buff, matrice->size);
+		}
+	return n > 0 || finished;
+	}
+
+int
+load_wait(int64_t row)
+	{
+	/* Keys typed meanwhile go back to the input once the rows are there, Ctrl-C gives up */
+	int typed[LOAD_KEYS], n = 0, ret = 1;
+	while (load != NULL && matrice->rows <= row)
+		{
+		load_rows();
+		when_resize();
+		draw();
+		timeout(LOAD_TICK);
+		int key = getch();
+		timeout(-1);
+		if (key == '\x03')
+			{
+			ret = 0;
+			break;
+			}
+		if (key != ERR && n < LOAD_KEYS)
+			typed[n++] = key;
+		}
+	while (n > 0) /* ungetch() hands back the last key first */
+		ungetch(typed[--n]);
+	return ret;
+	}
+
+void
+load_stop(void)
+	{
+	if (load == NULL) return;
+	pthread_mutex_lock(&load->lock);
+	load->stop = 1;
+	pthread_mutex_unlock(&load->lock);
+	if (!pthread_equal(load->tid, pthread_self()))
+		pthread_join(load->tid, NULL);
+	free_matrix(&load->m, load->rows);
+	free(load->index);
+	pthread_mutex_destroy(&load->lock);
+	free(load);
+	load = NULL;
+	}
+
+void
+append_rows(char ***m, int64_t n, int64_t cols)
+	{
+	if (n > 0 || cols > matrice->cols)
+		{
+		damaged = 1;
+		disp_gen++;
+		}
+	if (matrice->col != NULL || matrice->pack != NULL || matrice->sparse != NULL)
+		{
+		if (cols > matrice->cols)
+			cols_insert(matrice->cols, cols - matrice->cols);
+		rows_insert(matrice->rows, n);
+		for (int64_t i = 0; i < n; i++)
+			{
+			for (int64_t j = 0; j < cols; j++)
+				if (m[i][j] != NULL)
+					set_cell(matrice->rows - n + i, j, m[i][j]);
+			free(m[i]);
+			}
+		free(m);
+		return;
+		}
+	dense_flat();
+	if (cols > matrice->cols)
+		{
+		struct Parse p = {.matrix = matrice->m, .row = matrice->rows, .cols_max = matrice->cols, .width = cols};
+		pad_chunk(&p);
+		matrice->cols = cols;
+		}
+	else if (cols < matrice->cols)
+		{
+		struct Parse p = {.matrix = m, .row = n, .cols_max = cols, .width = matrice->cols};
+		pad_chunk(&p);
+		}
+	if (n > 0)
+		{
+		matrice->m = xrealloc(matrice->m, (matrice->rows + n) * sizeof(char **));
+		memcpy(matrice->m + matrice->rows, m, n * sizeof(char **));
+		matrice->rows += n;
+		matrice->gap_len = 0;
+		}
+	free(m);
+	}
+
+void
+follow_start(FILE *file, int tail)
+	{
+	follow = xmalloc(sizeof(struct Follow));
+	*follow = (struct Follow){.fd = file != NULL ? fileno(file) : STDIN_FILENO, .tail = tail};
+	struct stat st;
+	follow->pipe = fstat(follow->fd, &st) != 0 || !S_ISREG(st.st_mode);
+	if (follow->pipe && tail)
+		fcntl(follow->fd, F_SETFL, fcntl(follow->fd, F_GETFL) | O_NONBLOCK);
+	if (!matrice->mapsize)
+		{
+		follow->fresh = 1;
+		return;
+		}
+
+	/* A last line without its newline is still being written */
+	size_t off = matrice->size;
+	while (off > 0 && matrice->buff[off - 1] != '\n')
+		off--;
+	lseek(follow->fd, off, SEEK_SET);
+	if (off == 0)
+		{
+		/* Same placeholder as an empty file, the text is read again */
+		matrice->buff[0] = '\n';
+		off = 1;
+		follow->fresh = 1;
+		}
+	matrice->buff[off] = '\0';
+	matrice->size = off;
+	}
+
+int
+follow_rows(void)
+	{
+	if (follow == NULL || follow->fd < 0 || load != NULL) return 0;
+	ssize_t got = 0;
+	while (follow->len < (size_t)PARSE_CHUNK * jobs)
+		{
+		if (follow->len + READALL_CHUNK + 1 > follow->size)
+			{
+			follow->size = 2 * follow->size + READALL_CHUNK + 1;
+			follow->part = xrealloc(follow->part, follow->size);
+			}
+		got = read(follow->fd, follow->part + follow->len, READALL_CHUNK);
+		if (got <= 0)
+			break;
+		follow->len += got;
+		}
+	int eof = follow->pipe && (got == 0 || (got < 0 && errno != EAGAIN && errno != EINTR));
+
+	/* Only whole lines are parsed, unless no more are coming */
+	size_t used = follow->len;
+	while (!eof && used > 0 && follow->part[used - 1] != '\n')
+		used--;
+	if (eof)
+		{
+		close(follow->fd);
+		follow->fd = -1;
+		if (follow->pid > 0)
+			{
+			int status;
+			waitpid(follow->pid, &status, 0);
+			follow->failed = !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+			}
+		follow->pid = 0;
+		if (follow->failed && follow->tail)
+			codec_failed();
+		}
+	if (used == 0)
+		return eof;
+
+	char *buff = follow->part;
+	follow->len -= used;
+	follow->size = follow->len + READALL_CHUNK + 1;
+	follow->part = xmalloc(follow->size);
+	memcpy(follow->part, buff + used, follow->len);
+	buff = xrealloc(buff, used + 1);
+	buff[used] = '\0';
+	keep_text(buff);
+
+	detect_dialect(buff, buff + used);
+	int64_t rows, cols;
+	char ***m = parse_range(buff, buff + used, &follow->quoted, &rows, &cols);
+	if (follow->fresh && uhead->prev == NULL && uhead->next == NULL)
+		{
+		rows_cut(0, matrice->rows);
+		cols_cut(0, matrice->cols);
+		}
+	follow->fresh = 0;
+	int tail = follow->tail && y >= matrice->rows - 1;
+	append_rows(m, rows, cols);
+	if (tail && matrice->rows > 0)
+		{
+		win_scroll = 0;
+		y = matrice->rows - 1;
+		move_y_visual();
+		}
+	return 1;
+	}
+
+void
+follow_stop(void)
+	{
+	if (follow == NULL) return;
+	if (follow->fd >= 0)
+		close(follow->fd);
+	if (follow->pid > 0)
+		{
+		kill(follow->pid, SIGTERM);
+		waitpid(follow->pid, NULL, 0);
+		}
+	free(follow->part);
+	free(follow);
+	follow = NULL;
+	}
+
+void
+fit_start(void)
+	{
+	/* Widths come from a sample of rows measured between keys, opening never waits for it */
+	fit_free();
+	fit = xmalloc(sizeof(struct Fit));
+	*fit = (struct Fit){0, 0, NULL, NULL, 0x9e3779b97f4a7c15, 0};
+	}
+
+int
+fit_rows(void)
+	{
+	/* Measure the next slice of the sample, true when a width changed */
+	if (fit == NULL) return 0;
+	int64_t n = matrice->cols < FIT_COLS ? matrice->cols : FIT_COLS;
+	if (n > fit->cols) /* loaded or appended rows can be wider */
+		{
+		fit->hist = xrealloc(fit->hist, n * FIT_MAX * sizeof(uint32_t));
+		fit->hand = xrealloc(fit->hand, n);
+		memset(fit->hist + fit->cols * FIT_MAX, 0, (n - fit->cols) * FIT_MAX * sizeof(uint32_t));
+		memset(fit->hand + fit->cols, 0, n - fit->cols);
+		fit->cols = n;
+		}
+	fit->idle = 0;
+	int64_t sample = FIT_SAMPLE / (fit->cols + 1);
+	if (sample < FIT_HEAD) sample = FIT_HEAD;
+	for (int64_t cells = 0; cells < FIT_CELLS && fit->seen < sample; cells += fit->cols + 1)
+		{
+		int64_t i = fit->seen;
+		/* Past the head of a long table rows are picked at random, blocks of a virtual one are read in order */
+		if (matrice->rows > sample && i >= FIT_HEAD && matrice->virt == NULL)
+			{
+			fit->rng ^= fit->rng << 13;
+			fit->rng ^= fit->rng >> 7;
+			fit->rng ^= fit->rng << 17;
+			i = FIT_HEAD + fit->rng % (matrice->rows - FIT_HEAD);
+			}
+		else if (i >= matrice->rows)
+			{
+			fit->idle = 1;
+			break;
+			}
+		for (int64_t j = 0; j < fit->cols; j++)
+			{
+			char *cell = get_cell(i, j);
+			if (cell != NULL && *cell != '\0')
+				fit->hist[j * FIT_MAX + fit_text(cell)]++;
+			}
+		fit->seen++;
+		}
+	unsigned long changed = layout_gen;
+	fit_update();
+	if (fit->seen >= sample || (fit->idle && load == NULL && (follow == NULL || follow->fd < 0)))
+		fit_free();
+	return layout_gen != changed;
+	}
+
+void
+fit_update(void)
+	{
+	/* The narrowest width that shows FIT_SHARE percent of the cells whole */
+	if (n_col_w < fit->cols)
+		{
+		col_w = xrealloc(col_w, fit->cols * sizeof(int));
+		for (int64_t j = n_col_w; j < fit->cols; j++)
+			col_w[j] = cell_width;
+		n_col_w = fit->cols;
+		}
+	int changed = 0;
+	for (int64_t j = 0; j < fit->cols; j++)
+		{
+		if (fit->hand[j]) continue;
+		uint32_t *h = fit->hist + j * FIT_MAX;
+		uint64_t total = 0, sum = 0;
+		for (int w = 0; w < FIT_MAX; w++)
+			total += h[w];
+		int w = 0;
+		while (w < FIT_MAX - 1 && (sum += h[w]) * 100 < total * FIT_SHARE)
+			w++;
+		w = total == 0 ? FIT_MIN : w + 1 < FIT_MIN ? FIT_MIN : w + 1;
+		if (w != col_w[j])
+			{
+			col_w[j] = w;
+			changed = 1;
+			}
+		}
+	if (changed)
+		layout_changed();
+	}
+
+int
+fit_text(const char *cell)
+	{
+	/* Display width of a cell, up to FIT_MAX - 1 */
+	size_t n = ascii_span(cell, FIT_MAX - 1);
+	if (n == FIT_MAX - 1 || cell[n] == '\0')
+		return n;
+	wchar_t buffer[FIT_MAX];
+	size_t len = mbstowcs(buffer, cell, FIT_MAX - 1);
+	if (len == (size_t)-1)
+		return FIT_MAX - 1;
+	int w = 0;
+	for (size_t i = 0; i < len && w < FIT_MAX - 1; i++)
+		if (wc_width(buffer[i]) > 0)
+			w += wc_width(buffer[i]);
+	return w < FIT_MAX - 1 ? w : FIT_MAX - 1;
+	}
+
+void
+fit_cols_insert(int64_t at, int64_t n)
+	{
+	/* New columns keep cell_width until they are resized by hand */
+	if (at < n_col_w)
+		{
+		col_w = xrealloc(col_w, (n_col_w + n) * sizeof(int));
+		memmove(col_w + at + n, col_w + at, (n_col_w - at) * sizeof(int));
+		for (int64_t j = at; j < at + n; j++)
+			col_w[j] = cell_width;
+		n_col_w += n;
+		layout_changed();
+		}
+	if (fit != NULL && at < fit->cols)
+		{
+		fit->hist = xrealloc(fit->hist, (fit->cols + n) * FIT_MAX * sizeof(uint32_t));
+		fit->hand = xrealloc(fit->hand, fit->cols + n);
+		memmove(fit->hist + (at + n) * FIT_MAX, fit->hist + at * FIT_MAX, (fit->cols - at) * FIT_MAX * sizeof(uint32_t));
+		memmove(fit->hand + at + n, fit->hand + at, fit->cols - at);
+		memset(fit->hist + at * FIT_MAX, 0, n * FIT_MAX * sizeof(uint32_t));
+		memset(fit->hand + at, 1, n);
+		fit->cols += n;
+		}
+	}
+
+void
+fit_cols_cut(int64_t at, int64_t n)
+	{
+	if (at < n_col_w)
+		{
+		int64_t k = at + n < n_col_w ? n : n_col_w - at;
+		memmove(col_w + at, col_w + at + k, (n_col_w - at - k) * sizeof(int));
+		n_col_w -= k;
+		layout_changed();
+		}
+	if (fit != NULL && at < fit->cols)
+		{
+		int64_t k = at + n < fit->cols ? n : fit->cols - at;
+		memmove(fit->hist + at * FIT_MAX, fit->hist + (at + k) * FIT_MAX, (fit->cols - at - k) * FIT_MAX * sizeof(uint32_t));
+		memmove(fit->hand + at, fit->hand + at + k, fit->cols - at - k);
+		fit->cols -= k;
+		}
+	}
+
+void
+fit_free(void)
+	{
+	if (fit == NULL) return;
+	free(fit->hist);
+	free(fit->hand);
+	free(fit);
+	fit = NULL;
+	}
+
+struct Codec *
+codec_magic(FILE *file)
+	{
+	char head[8];
+	ssize_t len = file != NULL ? pread(fileno(file), head, sizeof(head), 0) : -1;
+	for (size_t i = 0; i < sizeof(codecs) / sizeof(codecs[0]); i++)
+		if (len >= codecs[i].len && memcmp(head, codecs[i].magic, codecs[i].len) == 0)
+			return &codecs[i];
+	return NULL;
+	}
+
+struct Codec *
+codec_ext(char *name)
+	{
+	size_t len = strlen(name);
+	for (size_t i = 0; i < sizeof(codecs) / sizeof(codecs[0]); i++)
+		{
+		size_t n = strlen(codecs[i].ext);
+		if (len > n && strcmp(name + len - n, codecs[i].ext) == 0)
+			return &codecs[i];
+		}
+	return NULL;
+	}
+
+FILE *
+codec_open(FILE *file, struct Codec *codec, int pack, pid_t *pid)
+	{
+	/* The program runs beside csvis, so it (de)compresses while the table is parsed */
+	int p[2];
+	if (pipe(p) == -1)
+		return NULL;
+	signal(SIGPIPE, SIG_IGN);
+	*pid = fork();
+	if (*pid == -1)
+		{
+		close(p[0]);
+		close(p[1]);
+		return NULL;
+		}
+	else if (*pid == 0)
+		{
+		dup2(pack ? p[0] : fileno(file), STDIN_FILENO);
+		dup2(pack ? fileno(file) : p[1], STDOUT_FILENO);
+		close(p[0]);
+		close(p[1]);
+		execlp(codec->prog, codec->prog, pack ? "-cq" : "-dcq", (char *)NULL);
+		exit(EXIT_FAILURE);
+		}
+	close(pack ? p[0] : p[1]);
+	return fdopen(pack ? p[1] : p[0], pack ? "w" : "r");
+	}
+
+void
+codec_failed(void)
+	{
+	/* Whatever was read is not the file, so it must not be saved over it */
+	char msg[128];
+	snprintf(msg, sizeof(msg), "%s could not decompress %s", follow->prog, fname != NULL ? fname : "the input");
+	free(fname);
+	fname = NULL;
+	statusbar(msg);
+	}
+
+void
+free_matrix(char ****matrix, int64_t n_rows)
+	{
+	for (int64_t i = 0; i < n_rows; i++)
+		free((*matrix)[i]);
+	free(*matrix);
+	}
+
+char **
+dense_row(int64_t y)
+	{
+	return matrice->m[y < matrice->gap ? y : y + matrice->gap_len];
+	}
+
+char **
+dense_cell(int64_t y, int64_t x)
+	{
+	if (matrice->colmap == NULL)
+		return &dense_row(y)[x];
+	int64_t p = matrice->colmap[x];
+	if (p < matrice->width)
+		return &dense_row(y)[p];
+	return &matrice->xcol[p - matrice->width][y < matrice->gap ? y : y + matrice->gap_len];
+	}
+
+int64_t
+dense_slot(void)
+	{
+	/* A slot for a new column, every cell of it NULL: spare ones were cleared when cut */
+	int64_t len = matrice->rows + matrice->gap_len;
+	if (matrice->n_spare > 0)
+		return matrice->spare[--matrice->n_spare];
+	char **cells = calloc(len > 0 ? len : 1, sizeof(char *));
+	if (cells == NULL)
+		{
+		fprintf(stderr, "calloc: %s\n", strerror(errno));
+		die();
+		exit(EXIT_FAILURE);
+		}
+	matrice->xcol = xrealloc(matrice->xcol, (matrice->n_xcol + 1) * sizeof(char **));
+	matrice->xcol[matrice->n_xcol] = cells;
+	return matrice->width + matrice->n_xcol++;
+	}
+
+void
+dense_flat(void)
+	{
+	/* Back to rows that hold every column in order, for code that reads m directly */
+	pack_rows();
+	sparse_rows();
+	gap_move(matrice->rows);
+	if (matrice->colmap == NULL)
+		return;
+	for (int64_t i = 0; i < matrice->rows; i++)
+		{
+		char **row = xmalloc((matrice->cols > 0 ? matrice->cols : 1) * sizeof(char *));
+		for (int64_t j = 0; j < matrice->cols; j++)
+			row[j] = *dense_cell(i, j);
+		free(matrice->m[i]);
+		matrice->m[i] = row;
+		}
+	dense_free();
+	}
+
+void
+dense_free(void)
+	{
+	for (int64_t k = 0; k < matrice->n_xcol; k++)
+		free(matrice->xcol[k]);
+	free(matrice->xcol);
+	free(matrice->colmap);
+	free(matrice->spare);
+	matrice->xcol = NULL;
+	matrice->n_xcol = 0;
+	matrice->colmap = NULL;
+	matrice->spare = NULL;
+	matrice->n_spare = 0;
+	}
+
+void
+gap_move(int64_t at)
+	{
+	/* Edits near the last one move few row pointers */
+	int64_t len = matrice->gap_len, gap = matrice->gap;
+	for (int64_t k = -1; len > 0 && k < matrice->n_xcol; k++)
+		{
+		char **m = k < 0 ? (char **)matrice->m : matrice->xcol[k];
+		if (at < gap)
+			memmove(m + at + len, m + at, (gap - at) * sizeof(char *));
+		else if (at > gap)
+			memmove(m + gap, m + gap + len, (at - gap) * sizeof(char *));
+		}
+	matrice->gap = at;
+	}
+
+char *
+get_cell(int64_t y, int64_t x)
+	{
+	if (matrice->virt != NULL)
+		return virt_get(y, x);
+	if (matrice->col != NULL)
+		return col_get(y, x);
+	if (matrice->pack != NULL)
+		return pack_get(y, x);
+	if (matrice->sparse != NULL)
+		return sparse_get(y, x);
+	return *dense_cell(y, x);
+	}
+
+void
+set_cell(int64_t y, int64_t x, char *str)
+	{
+	damaged = 1;
+	disp_gen++;
+	if (matrice->virt != NULL)
+		virt_set(y, x, str);
+	else if (matrice->col != NULL)
+		col_set(y, x, str);
+	else if (matrice->pack != NULL)
+		pack_set(y, x, str);
+	else if (matrice->sparse != NULL)
+		sparse_set(y, x, str);
+	else
+		*dense_cell(y, x) = str;
+	}
+
+char *
+take_cell(int64_t y, int64_t x)
+	{
+	damaged = 1;
+	disp_gen++;
+	if (matrice->virt != NULL)
+		return virt_take(y, x);
+	if (matrice->col != NULL)
+		return col_take(y, x);
+	if (matrice->pack != NULL)
+		return pack_take(y, x);
+	if (matrice->sparse != NULL)
+		return sparse_take(y, x);
+	char **cell = dense_cell(y, x);
+	char *temp = *cell;
+	*cell = NULL;
+	return temp;
+	}
+
+void
+rows_insert(int64_t at, int64_t n)
+	{
+	if (n <= 0) return;
+	damaged = 1;
+	if (matrice->virt != NULL)
+		virt_rows_insert(at, n);
+	else if (matrice->col != NULL)
+		col_rows_insert(at, n);
+	else if (matrice->pack != NULL)
+		pack_rows_insert(at, n);
+	else if (matrice->sparse != NULL)
+		sparse_rows_insert(at, n);
+	else
+		{
+		if (matrice->gap_len < n)
+			{
+			/* Grow by a share of the table so inserts stay cheap on average */
+			gap_move(matrice->rows);
+			int64_t len = n + matrice->rows / 8 + GAP_ROWS;
+			matrice->m = xrealloc(matrice->m, (matrice->rows + len) * sizeof(char **));
+			for (int64_t k = 0; k < matrice->n_xcol; k++)
+				matrice->xcol[k] = xrealloc(matrice->xcol[k], (matrice->rows + len) * sizeof(char *));
+			matrice->gap_len = len;
+			}
+		gap_move(at);
+		int64_t width = matrice->colmap != NULL ? matrice->width : matrice->cols;
+		for (int64_t i = at; i < at + n; i++)
+			{
+			matrice->m[i] = xmalloc(width * sizeof(char *));
+			for (int64_t j = 0; j < width; j++)
+				matrice->m[i][j] = NULL;
+			}
+		for (int64_t k = 0; k < matrice->n_xcol; k++)
+			memset(matrice->xcol[k] + at, 0, n * sizeof(char *));
+		matrice->gap += n;
+		matrice->gap_len -= n;
+		}
+	matrice->rows += n;
+	}
+
+void
+rows_cut(int64_t at, int64_t n)
+	{
+	if (n <= 0) return;
+	damaged = 1;
+	if (matrice->virt != NULL)
+		virt_rows_cut(at, n);
+	else if (matrice->col != NULL)
+		col_rows_cut(at, n);
+	else if (matrice->pack != NULL)
+		pack_rows_cut(at, n);
+	else if (matrice->sparse != NULL)
+		sparse_rows_cut(at, n);
+	else
+		{
+		gap_move(at + n);
+		for (int64_t i = at; i < at + n; i++)
+			free(matrice->m[i]);
+		matrice->gap -= n;
+		matrice->gap_len += n;
+		}
+	matrice->rows -= n;
+	}
+
+void
+cols_insert(int64_t at, int64_t n)
+	{
+	if (n <= 0) return;
+	damaged = 1;
+	if (matrice->virt != NULL)
+		virt_cols_insert(at, n);
+	else if (matrice->col != NULL)
+		col_cols_insert(at, n);
+	else if (matrice->pack != NULL)
+		pack_cols_insert(at, n);
+	else if (matrice->sparse != NULL)
+		sparse_cols_insert(at, n);
+	else
+		{
+		/* Only the new columns are stored, the rows stay as they are */
+		if (matrice->colmap == NULL)
+			{
+			matrice->colmap = xmalloc((matrice->cols + n) * sizeof(int64_t));
+			for (int64_t j = 0; j < matrice->cols; j++)
+				matrice->colmap[j] = j;
+			matrice->width = matrice->cols;
+			}
+		else
+			matrice->colmap = xrealloc(matrice->colmap, (matrice->cols + n) * sizeof(int64_t));
+		memmove(matrice->colmap + at + n, matrice->colmap + at, (matrice->cols - at) * sizeof(int64_t));
+		for (int64_t j = at; j < at + n; j++)
+			matrice->colmap[j] = dense_slot();
+		}
+	matrice->cols += n;
+	fit_cols_insert(at, n);
+	}
+
+void
+cols_cut(int64_t at, int64_t n)
+	{
+	if (n <= 0) return;
+	damaged = 1;
+	if (matrice->virt != NULL)
+		virt_cols_cut(at, n);
+	else if (matrice->col != NULL)
+		col_cols_cut(at, n);
+	else if (matrice->pack != NULL)
+		pack_cols_cut(at, n);
+	else if (matrice->sparse != NULL)
+		sparse_cols_cut(at, n);
+	else
+		{
+		if (matrice->colmap == NULL)
+			{
+			matrice->colmap = xmalloc(matrice->cols * sizeof(int64_t));
+			for (int64_t j = 0; j < matrice->cols; j++)
+				matrice->colmap[j] = j;
+			matrice->width = matrice->cols;
+			}
+		/* The cells were walked to cut them, clearing them here keeps inserts cheap */
+		for (int64_t j = at; j < at + n; j++)
+			{
+			int64_t p = matrice->colmap[j];
+			if (p >= matrice->width)
+				memset(matrice->xcol[p - matrice->width], 0, (matrice->rows + matrice->gap_len) * sizeof(char *));
+			else
+				{
+				for (int64_t i = 0; i < matrice->rows; i++)
+					dense_row(i)[p] = NULL;
+				}
+			}
+		matrice->spare = xrealloc(matrice->spare, (matrice->n_spare + n) * sizeof(int64_t));
+		memcpy(matrice->spare + matrice->n_spare, matrice->colmap + at, n * sizeof(int64_t));
+		matrice->n_spare += n;
+		memmove(matrice->colmap + at, matrice->colmap + at + n, (matrice->cols - at - n) * sizeof(int64_t));
+		}
+	matrice->cols -= n;
+	fit_cols_cut(at, n);
+	}
+
+void
+scan_row(struct Scan *s, int64_t *n, char *next, int quoted)
+	{
+	for (int h = 0; h < 2; h++)
+		{
+		if (n[h] + 1 > s->width[h])
+			s->width[h] = n[h] + 1;
+		n[h] = 0;
+		}
+	s->rows++;
+	struct Index *last = &s->index[s->n - 1];
+	if (next < s->end && (s->rows - last->row >= VIRT_ROWS || (size_t)(next - s->begin) - last->off >= VIRT_BYTES))
+		{
+		if (s->n == s->n_s)
+			{
+			s->n_s *= 2;
+			s->index = xrealloc(s->index, s->n_s * sizeof(struct Index));
+			}
+		s->index[s->n++] = (struct Index){next - s->begin, s->rows, quoted};
+		}
+	}
+
+void *
+scan_chunk(void *arg)
+	{
+	struct Scan *s = arg;
+	char *nul = memchr(s->begin, '\0', s->end - s->begin);
+	s->nul = nul != NULL;
+	if (nul != NULL)
+		s->end = nul;
+	char *k = s->begin;
+	char *end = s->end;
+	char *start = k; /* start of the current row */
+	int start_quoted = 0;
+	int in_quotes = 0;
+	int64_t n[2] = {0, 0}; /* separators in the current row for either starting quote state */
+	s->n_s = 32;
+	s->index = xmalloc(s->n_s * sizeof(struct Index));
+	s->n = s->rows = s->width[0] = s->width[1] = 0;
+	if (k < end)
+		s->index[s->n++] = (struct Index){0, 0, 0};
+	int simd = classify != NULL && fs != '\n' && fs != '"' && fs != '\r';
+	while (k < end)
+		{
+		if (simd && end - k >= 64)
+			{
+			uint64_t mask[4];
+			classify(k, mask);
+			uint64_t quoted = prefix_xor(mask[2]) ^ -(uint64_t)in_quotes;
+			in_quotes = quoted >> 63;
+			uint64_t out = mask[0] & ~quoted;
+			uint64_t in = mask[0] & quoted;
+			uint64_t nl = mask[1];
+			while (nl)
+				{
+				int b = __builtin_ctzll(nl);
+				uint64_t done = (2ULL << b) - 1;
+				n[0] += __builtin_popcountll(out & done);
+				n[1] += __builtin_popcountll(in & done);
+				out &= ~done;
+				in &= ~done;
+				nl &= nl - 1;
+				start = k + b + 1;
+				start_quoted = quoted >> b & 1;
+				scan_row(s, n, start, start_quoted);
+				}
+			n[0] += __builtin_popcountll(out);
+			n[1] += __builtin_popcountll(in);
+			k += 64;
+			continue;
+			}
+		if (*k == fs) n[in_quotes]++;
+		else if (*k == '\n')
+			{
+			start = k + 1;
+			start_quoted = in_quotes;
+			scan_row(s, n, start, start_quoted);
+			}
+		else if (*k == '"') in_quotes = !in_quotes;
+		k++;
+		}
+	s->parity = in_quotes;
+
+	/* Like parse_chunk(), the last row drops an empty cell after a trailing separator */
+	if (start < end)
+		{
+		for (int h = 0; h < 2; h++)
+			{
+			int q = start_quoted ^ h;
+			char *cell = start;
+			n[h] = 0;
+			for (char *j = start; j < end; j++)
+				{
+				if (*j == fs && !q)
+					{
+					n[h]++;
+					cell = j + 1;
+					}
+				else if (*j == '"') q = !q;
+				}
+			if (cell == end) n[h]--;
+			}
+		scan_row(s, n, end, 0);
+		}
+	return NULL;
+	}
+
+int
+virt_scan(struct Virt *v, char *begin, char *end, int *quoted)
+	{
+	char *k = begin;
+	size_t len = end - begin;
+	int n = jobs;
+	if ((size_t)n > len / PARSE_CHUNK) n = len / PARSE_CHUNK;
+	if (n < 1) n = 1;
+
+	struct Scan s[n];
+	for (int i = 0; i < n; i++)
+		{
+		char *cut = begin + len/n*(i + 1);
+		char *nl = NULL;
+		if (cut < k) cut = k;
+		if (i < n - 1)
+			nl = memchr(cut, '\n', end - cut);
+		s[i].begin = k;
+		s[i].end = k = nl != NULL ? nl + 1 : end;
+		}
+	parallel(scan_chunk, s, sizeof(*s), n);
+
+	/* Chunks counted both ways, now the quote state at each is known */
+	int nul = 0;
+	for (int i = 0; i < n; i++)
+		{
+		if (!nul && s[i].n > 0)
+			{
+			v->index = xrealloc(v->index, (v->n + s[i].n) * sizeof(struct Index));
+			for (int64_t j = 0; j < s[i].n; j++)
+				{
+				struct Index *e = &s[i].index[j];
+				v->index[v->n++] = (struct Index){e->off + (s[i].begin - matrice->buff), e->row + v->rows, e->quoted ^ *quoted};
+				}
+			v->rows += s[i].rows;
+			if (s[i].width[*quoted] > v->cols)
+				v->cols = s[i].width[*quoted];
+			*quoted ^= s[i].parity;
+			v->end = s[i].end;
+			}
+		nul |= s[i].nul;
+		free(s[i].index);
+		}
+	return nul;
+	}
+
+uint64_t
+hash_ends(void)
+	{
+	/* FNV-1a over the head and the tail of the file */
+	uint64_t h = 14695981039346656037ULL;
+	size_t n = matrice->size < INDEX_HASH ? matrice->size : INDEX_HASH;
+	for (size_t i = 0; i < n; i++)
+		h = (h ^ (unsigned char)matrice->buff[i]) * 1099511628211ULL;
+	for (size_t i = matrice->size - n; i < matrice->size; i++)
+		h = (h ^ (unsigned char)matrice->buff[i]) * 1099511628211ULL;
+	return h;
+	}
+
+int
+index_key(struct Sidecar *h)
+	{
+	struct stat st;
+	if (fname == NULL || stat(fname, &st) != 0)
+		return 0;
+	memset(h, 0, sizeof(*h));
+	memcpy(h->magic, INDEX_MAGIC, sizeof(h->magic));
+	h->size = matrice->size;
+	h->mtime = st.st_mtim;
+	h->hash = hash_ends();
+	h->fs = fs;
+	return 1;
+	}
+
+int
+index_read(struct Virt *v)
+	{
+	struct Sidecar h;
+	char name[strlen(fname) + sizeof(INDEX_EXT)];
+	sprintf(name, "%s" INDEX_EXT, fname);
+	FILE *file = fopen(name, "r");
+	if (file == NULL)
+		return 0;
+	/* Anything but the exact file it was built from makes it stale */
+	int ok = fread(&h, sizeof(h), 1, file) == 1
+		&& memcmp(h.magic, v->head.magic, sizeof(h.magic)) == 0
+		&& h.size == v->head.size
+		&& h.mtime.tv_sec == v->head.mtime.tv_sec
+		&& h.mtime.tv_nsec == v->head.mtime.tv_nsec
+		&& h.hash == v->head.hash
+		&& h.fs == v->head.fs
+		&& h.n > 0 && h.n <= h.rows && h.end <= h.size && h.end <= matrice->size
+		&& h.cols > 0 && (size_t)h.cols <= h.size;
+	if (ok)
+		{
+		v->index = xmalloc(h.n * sizeof(struct Index));
+		ok = fread(v->index, sizeof(struct Index), h.n, file) == (size_t)h.n;
+		}
+	/* A damaged file must not send lookups outside the mapping or start them in the wrong quote state */
+	for (int64_t i = 0; ok && i < h.n; i++)
+		ok = v->index[i].off < h.end && v->index[i].off < matrice->size
+			&& (v->index[i].quoted == 0 || v->index[i].quoted == 1)
+			&& v->index[i].row <= h.rows
+			&& (i == 0 ? v->index[i].row >= 0
+				: v->index[i].off > v->index[i - 1].off && v->index[i].row > v->index[i - 1].row);
+	fclose(file);
+	if (!ok)
+		{
+		free(v->index);
+		v->index = NULL;
+		return 0;
+		}
+	v->n = h.n;
+	v->rows = h.rows;
+	v->cols = h.cols;
+	v->end = matrice->buff + h.end;
+	return 1;
+	}
+
+void *
+index_write(void *arg)
+	{
+	struct Virt *v = arg;
+	struct Sidecar h = v->head;
+	h.rows = v->rows;
+	h.cols = v->cols;
+	h.n = v->n;
+	h.end = v->end - matrice->buff;
+	char name[strlen(fname) + sizeof(INDEX_EXT)];
+	char temp[sizeof(name) + 1];
+	sprintf(name, "%s" INDEX_EXT, fname);
+	sprintf(temp, "%s~", name);
+	FILE *file = fopen(temp, "w");
+	if (file == NULL)
+		return NULL;
+	int ok = fwrite(&h, sizeof(h), 1, file) == 1
+		&& fwrite(v->index, sizeof(struct Index), v->n, file) == (size_t)v->n;
+	if (fclose(file) == 0 && ok)
+		rename(temp, name);
+	else
+		unlink(temp);
+	return NULL;
+	}
+
+void
+index_save(struct Virt *v)
+	{
+	if (v->keyed && pthread_create(&v->writer, NULL, index_write, v) == 0)
+		v->writing = 1;
+	}
+
+int
+virt_open(void)
+	{
+	/* Rows would depend on the quote state */
+	if (fs == '"' || fs == '\n') return 0;
+	struct Virt *v = xmalloc(sizeof(struct Virt));
+	*v = (struct Virt){.next = NEWROW, .fs = fs};
+	/* A saved index spares the scan, a missing or stale one is written again */
+	int keyed = sidecar && index_key(&v->head);
+	char *pos = NULL;
+	int quoted = 0;
+	if (!keyed || !index_read(v))
+		{
+		/* Like load_start(), the first screenfuls here and the rest in the background */
+		char *end = matrice->buff + matrice->size;
+		pos = matrice->size > LOAD_ASYNC ? slice_end(matrice->buff, end, LOAD_CHUNK) : end;
+		virt_scan(v, matrice->buff, pos, &quoted);
+		if (v->rows == 0)
+			{
+			free(v->index);
+			free(v);
+			return 0;
+			}
+		v->keyed = keyed;
+		if (pos == end || *pos == '\0')
+			{
+			index_save(v);
+			pos = NULL;
+			}
+		}
+
+	v->piece = xmalloc(sizeof(struct Piece));
+	v->piece[0] = (struct Piece){0, v->rows};
+	v->pieces = 1;
+	v->col = xmalloc(v->cols * sizeof(int64_t));
+	for (int64_t j = 0; j < v->cols; j++)
+		v->col[j] = j;
+	v->cap = 64;
+	v->key = xmalloc(v->cap * sizeof(int64_t));
+	v->val = xmalloc(v->cap * sizeof(char **));
+	for (size_t i = 0; i < v->cap; i++)
+		{
+		v->key[i] = -1;
+		v->val[i] = NULL;
+		}
+	for (int i = 0; i < VIRT_CACHE; i++)
+		v->cache[i].n = -1;
+	matrice->virt = v;
+	matrice->m = NULL;
+	matrice->rows = v->rows;
+	matrice->cols = v->cols;
+	damaged = 1;
+	disp_gen++;
+	if (pos != NULL)
+		load_run(pos, quoted, 1);
+	return 1;
+	}
+
+void
+virt_grow(struct Index *index, int64_t k, int64_t n, int64_t cols, char *end)
+	{
+	struct Virt *v = matrice->virt;
+	v->index = xrealloc(v->index, (v->n + k) * sizeof(struct Index));
+	for (int64_t i = 0; i < k; i++)
+		{
+		index[i].row += v->rows;
+		v->index[v->n++] = index[i];
+		}
+	free(index);
+	v->end = end;
+	if (cols > v->cols)
+		{
+		/* New file columns go after the table's, edited rows still read them from the file */
+		int64_t at = matrice->cols;
+		cols_insert(at, cols - v->cols);
+		for (int64_t j = at; j < matrice->cols; j++)
+			v->col[j] = v->cols + j - at;
+		for (size_t i = 0; i < v->cap; i++)
+			{
+			if (v->val[i] == NULL || v->key[i] >= NEWROW) continue;
+			for (int64_t j = at; j < matrice->cols; j++)
+				v->val[i][j] = filecell;
+			}
+		v->cols = cols;
+		}
+	if (n == 0)
+		return;
+	/* The rows go on the last piece unless it was cut short or inserted */
+	struct Piece *last = v->pieces > 0 ? &v->piece[v->pieces - 1] : NULL;
+	if (last != NULL && last->id < NEWROW && last->id + last->n == v->rows)
+		last->n += n;
+	else
+		{
+		v->piece = xrealloc(v->piece, (v->pieces + 1) * sizeof(struct Piece));
+		v->piece[v->pieces++] = (struct Piece){v->rows, n};
+		}
+	v->rows += n;
+	matrice->rows += n;
+	damaged = 1;
+	disp_gen++;
+	}
+
+struct Block *
+virt_block(int64_t id, int64_t *row)
+	{
+	struct Virt *v = matrice->virt;
+	struct Block *b = &v->cache[v->last];
+	if (b->n < 0 || id < v->index[b->n].row || (b->n + 1 < v->n && id >= v->index[b->n + 1].row))
+		{
+		int64_t lo = 0, hi = v->n - 1;
+		while (lo < hi)
+			{
+			int64_t mid = (lo + hi + 1) / 2;
+			if (v->index[mid].row <= id) lo = mid;
+			else hi = mid - 1;
+			}
+		int lru = 0;
+		for (v->last = 0; v->last < VIRT_CACHE; v->last++)
+			{
+			if (v->cache[v->last].n == lo) break;
+			if (v->cache[v->last].used < v->cache[lru].used) lru = v->last;
+			}
+		if (v->last == VIRT_CACHE) /* Split the rows again from a copy, the mapping stays untouched */
+			{
+			v->last = lru;
+			b = &v->cache[lru];
+			if (b->n >= 0)
+				{
+				free_matrix(&b->m, b->rows);
+				free(b->buff);
+				}
+			char *begin = matrice->buff + v->index[lo].off;
+			char *end = lo + 1 < v->n ? matrice->buff + v->index[lo + 1].off : v->end;
+			b->buff = xmalloc(end - begin + 1);
+			memcpy(b->buff, begin, end - begin);
+			b->buff[end - begin] = '\0';
+			struct Parse p = {.begin = b->buff, .end = b->buff + (end - begin), .quoted = v->index[lo].quoted};
+			char temp = fs;
+			fs = v->fs;
+			parse_chunk(&p);
+			fs = temp;
+			b->n = lo;
+			b->m = p.matrix;
+			b->rows = p.row;
+			b->cols = p.cols_max;
+			}
+		b = &v->cache[v->last];
+		}
+	b->used = ++v->clock;
+	*row = id - v->index[b->n].row;
+	return b;
+	}
+
+int64_t
+virt_piece(int64_t row)
+	{
+	struct Virt *v = matrice->virt;
+	if (row < v->memo_row)
+		v->memo_p = v->memo_row = 0;
+	while (v->memo_p < v->pieces && row >= v->memo_row + v->piece[v->memo_p].n)
+		v->memo_row += v->piece[v->memo_p++].n;
+	return v->memo_p;
+	}
+
+int64_t
+virt_id(int64_t row)
+	{
+	struct Virt *v = matrice->virt;
+	int64_t p = virt_piece(row);
+	return v->piece[p].id + (row - v->memo_row);
+	}
+
+char ***
+virt_row(int64_t id, int create)
+	{
+	struct Virt *v = matrice->virt;
+	size_t i = ((uint64_t)id * 0x9e3779b97f4a7c15 >> 32) & (v->cap - 1);
+	while (v->key[i] != -1 && v->key[i] != id)
+		i = (i + 1) & (v->cap - 1);
+	if (v->val[i] != NULL)
+		return &v->val[i];
+	if (!create)
+		return NULL;
+	if (v->key[i] == -1 && 2 * (v->used + 1) > v->cap)
+		{
+		/* Rows cut away keep their key, so only live ones move over */
+		size_t cap = v->cap;
+		int64_t *key = v->key;
+		char ***val = v->val;
+		v->cap *= 2;
+		v->used = 0;
+		v->key = xmalloc(v->cap * sizeof(int64_t));
+		v->val = xmalloc(v->cap * sizeof(char **));
+		for (size_t j = 0; j < v->cap; j++)
+			{
+			v->key[j] = -1;
+			v->val[j] = NULL;
+			}
+		for (size_t j = 0; j < cap; j++)
+			{
+			if (val[j] == NULL) continue;
+			size_t l = ((uint64_t)key[j] * 0x9e3779b97f4a7c15 >> 32) & (v->cap - 1);
+			while (v->key[l] != -1)
+				l = (l + 1) & (v->cap - 1);
+			v->key[l] = key[j];
+			v->val[l] = val[j];
+			v->used++;
+			}
+		free(key);
+		free(val);
+		return virt_row(id, create);
+		}
+	if (v->key[i] == -1)
+		{
+		v->key[i] = id;
+		v->used++;
+		}
+	v->val[i] = xmalloc(matrice->cols * sizeof(char *));
+	for (int64_t j = 0; j < matrice->cols; j++)
+		v->val[i][j] = id < NEWROW && v->col[j] >= 0 ? filecell : NULL;
+	return &v->val[i];
+	}
+
+char *
+virt_file(int64_t id, int64_t x)
+	{
+	struct Virt *v = matrice->virt;
+	if (id >= NEWROW || v->col[x] < 0)
+		return NULL;
+	int64_t i;
+	struct Block *b = virt_block(id, &i);
+	if (i >= b->rows || v->col[x] >= b->cols)
+		return NULL;
+	return b->m[i][v->col[x]];
+	}
+
+char *
+virt_get(int64_t y, int64_t x)
+	{
+	int64_t id = virt_id(y);
+	if (matrice->virt->used > 0)
+		{
+		char ***row = virt_row(id, 0);
+		if (row != NULL && (*row)[x] != filecell)
+			return (*row)[x];
+		}
+	return virt_file(id, x);
+	}
+
+void
+virt_set(int64_t y, int64_t x, char *str)
+	{
+	(*virt_row(virt_id(y), 1))[x] = str;
+	}
+
+char *
+virt_take(int64_t y, int64_t x)
+	{
+	int64_t id = virt_id(y);
+	char **row = *virt_row(id, 1);
+	char *temp = row[x];
+	if (temp == filecell) /* Copy it, undo keeps it longer than the cache */
+		{
+		temp = arena_str(virt_file(id, x));
+		}
+	row[x] = NULL;
+	return temp;
+	}
+
+int64_t
+virt_split(int64_t row)
+	{
+	struct Virt *v = matrice->virt;
+	int64_t p = virt_piece(row);
+	int64_t off = row - v->memo_row;
+	if (p == v->pieces || off == 0)
+		return p;
+	v->piece = xrealloc(v->piece, (v->pieces + 1) * sizeof(struct Piece));
+	memmove(v->piece + p + 1, v->piece + p, (v->pieces - p) * sizeof(struct Piece));
+	v->pieces++;
+	v->piece[p].n = off;
+	v->piece[p + 1].id += off;
+	v->piece[p + 1].n -= off;
+	return p + 1;
+	}
+
+void
+virt_rows_insert(int64_t at, int64_t n)
+	{
+	struct Virt *v = matrice->virt;
+	int64_t p = virt_split(at);
+	v->piece = xrealloc(v->piece, (v->pieces + 1) * sizeof(struct Piece));
+	memmove(v->piece + p + 1, v->piece + p, (v->pieces - p) * sizeof(struct Piece));
+	v->pieces++;
+	v->piece[p] = (struct Piece){v->next, n};
+	v->next += n;
+	v->memo_p = v->memo_row = 0;
+	}
+
+void
+virt_rows_cut(int64_t at, int64_t n)
+	{
+	struct Virt *v = matrice->virt;
+	int64_t p = virt_split(at);
+	int64_t q = virt_split(at + n);
+	for (int64_t i = p; i < q && v->used > 0; i++)
+		{
+		for (int64_t j = 0; j < v->piece[i].n; j++)
+			{
+			char ***row = virt_row(v->piece[i].id + j, 0);
+			if (row == NULL) continue;
+			free(*row);
+			*row = NULL;
+			}
+		}
+	memmove(v->piece + p, v->piece + q, (v->pieces - q) * sizeof(struct Piece));
+	v->pieces -= q - p;
+	v->memo_p = v->memo_row = 0;
+	}
+
+void
+virt_cols_insert(int64_t at, int64_t n)
+	{
+	struct Virt *v = matrice->virt;
+	v->col = xrealloc(v->col, (matrice->cols + n) * sizeof(int64_t));
+	memmove(v->col + at + n, v->col + at, (matrice->cols - at) * sizeof(int64_t));
+	for (int64_t j = at; j < at + n; j++)
+		v->col[j] = -1;
+	for (size_t i = 0; i < v->cap; i++)
+		{
+		if (v->val[i] == NULL) continue;
+		v->val[i] = xrealloc(v->val[i], (matrice->cols + n) * sizeof(char *));
+		memmove(v->val[i] + at + n, v->val[i] + at, (matrice->cols - at) * sizeof(char *));
+		for (int64_t j = at; j < at + n; j++)
+			v->val[i][j] = NULL;
+		}
+	}
+
+void
+virt_cols_cut(int64_t at, int64_t n)
+	{
+	struct Virt *v = matrice->virt;
+	memmove(v->col + at, v->col + at + n, (matrice->cols - at - n) * sizeof(int64_t));
+	for (size_t i = 0; i < v->cap; i++)
+		{
+		if (v->val[i] != NULL)
+			memmove(v->val[i] + at, v->val[i] + at + n, (matrice->cols - at - n) * sizeof(char *));
+		}
+	}
+
+void
+virt_free(void)
+	{
+	struct Virt *v = matrice->virt;
+	load_stop();
+	if (v->writing)
+		pthread_join(v->writer, NULL);
+	for (int i = 0; i < VIRT_CACHE; i++)
+		{
+		if (v->cache[i].n < 0) continue;
+		free_matrix(&v->cache[i].m, v->cache[i].rows);
+		free(v->cache[i].buff);
+		}
+	for (size_t i = 0; i < v->cap; i++)
+		free(v->val[i]);
+	free(v->key);
+	free(v->val);
+	free(v->piece);
+	free(v->col);
+	free(v->index);
+	free(v);
+	matrice->virt = NULL;
+	}
+
+int
+col_number(char *s, int64_t *num)
+	{
+	/* Only text that col_format() gives back byte for byte */
+	char *k = s + (*s == '-');
+	if (!isdigit(*k) || (*k == '0' && isdigit(k[1])))
+		return 0;
+	int64_t v = 0;
+	int digits = 0, point = -1;
+	for (; isdigit(*k) || (*k == '.' && point < 0 && isdigit(k[1])); k++)
+		{
+		if (*k == '.')
+			{
+			point = digits;
+			continue;
+			}
+		if (++digits > COL_DIGITS)
+			return 0;
+		v = v * 10 + (*k - '0');
+		}
+	int places = point < 0 ? 0 : digits - point;
+	if (*k != '\0' || (*s == '-' && v == 0) || places > 15)
+		return 0;
+	*num = (*s == '-' ? -v : v) * 16 + places;
+	return 1;
+	}
+
+char *
+col_format(int64_t v, char *out)
+	{
+	/* out holds COL_TEXT bytes */
+	if (v == COL_NULL)
+		return NULL;
+	if (v == COL_EMPTY)
+		return "";
+	char digits[COL_DIGITS + 2];
+	int n = 0;
+	int places = v & 15;
+	v = (v - places) / 16;
+	uint64_t u = v < 0 ? -(uint64_t)v : (uint64_t)v;
+	do
+		{
+		digits[n++] = '0' + u % 10;
+		u /= 10;
+		}
+	while (u > 0 || n <= places);
+	char *k = out;
+	if (v < 0)
+		*k++ = '-';
+	while (n > 0)
+		{
+		if (n == places)
+			*k++ = '.';
+		*k++ = digits[--n];
+		}
+	*k = '\0';
+	return out;
+	}
+
+char *
+col_shown(struct Column *c, int64_t v)
+	{
+	/* Every number is formatted once and kept with the column, like the text of other cells */
+	if (v == COL_NULL || v == COL_EMPTY)
+		return col_format(v, NULL);
+	if (2 * (c->n_shown + 1) > c->cap_shown)
+		{
+		char **shown = c->shown;
+		int64_t *num = c->shown_num;
+		size_t cap = c->cap_shown;
+		c->cap_shown = cap ? 2 * cap : 64;
+		c->shown = xmalloc(c->cap_shown * sizeof(char *));
+		c->shown_num = xmalloc(c->cap_shown * sizeof(int64_t));
+		for (size_t i = 0; i < c->cap_shown; i++)
+			c->shown[i] = NULL;
+		for (size_t j = 0; j < cap; j++)
+			{
+			if (shown[j] == NULL) continue;
+			size_t i = ((uint64_t)num[j] * 0x9e3779b97f4a7c15 >> 32) & (c->cap_shown - 1);
+			while (c->shown[i] != NULL)
+				i = (i + 1) & (c->cap_shown - 1);
+			c->shown[i] = shown[j];
+			c->shown_num[i] = num[j];
+			}
+		free(shown);
+		free(num);
+		}
+	size_t i = ((uint64_t)v * 0x9e3779b97f4a7c15 >> 32) & (c->cap_shown - 1);
+	while (c->shown[i] != NULL)
+		{
+		if (c->shown_num[i] == v)
+			return c->shown[i];
+		i = (i + 1) & (c->cap_shown - 1);
+		}
+	c->shown[i] = col_format(v, xmalloc(COL_TEXT));
+	c->shown_num[i] = v;
+	c->n_shown++;
+	return c->shown[i];
+	}
+
+void
+col_drop(struct Column *c)
+	{
+	for (size_t i = 0; i < c->cap_shown; i++)
+		free(c->shown[i]);
+	free(c->shown);
+	free(c->shown_num);
+	free(c->data);
+	free(c->dict);
+	free(c->slot);
+	}
+
+uint64_t
+hash_str(char *s)
+	{
+	uint64_t h = 14695981039346656037ULL;
+	for (; *s != '\0'; s++)
+		h = (h ^ (unsigned char)*s) * 1099511628211ULL;
+	return h;
+	}
+
+int
+col_code(struct Column *c, char *s, int64_t limit)
+	{
+	if (s == NULL)
+		return 0;
+	if (2 * (c->n_dict + 1) > (int64_t)c->cap)
+		{
+		free(c->slot);
+		c->cap = c->cap ? 2 * c->cap : 64;
+		c->slot = xmalloc(c->cap * sizeof(int32_t));
+		for (size_t i = 0; i < c->cap; i++)
+			c->slot[i] = -1;
+		for (int64_t d = 1; d < c->n_dict; d++)
+			{
+			size_t i = hash_str(c->dict[d]) & (c->cap - 1);
+			while (c->slot[i] != -1)
+				i = (i + 1) & (c->cap - 1);
+			c->slot[i] = d;
+			}
+		}
+	size_t i = hash_str(s) & (c->cap - 1);
+	while (c->slot[i] != -1)
+		{
+		if (strcmp(c->dict[c->slot[i]], s) == 0)
+			return c->slot[i];
+		i = (i + 1) & (c->cap - 1);
+		}
+	if (c->n_dict > limit)
+		return -1;
+	c->dict = xrealloc(c->dict, (c->n_dict + 1) * sizeof(char *));
+	c->dict[c->n_dict] = s;
+	c->slot[i] = c->n_dict;
+	return c->n_dict++;
+	}
+
+void
+col_infer(struct Column *c, int64_t j)
+	{
+	int64_t rows = matrice->rows;
+	char ***m = matrice->m;
+	int64_t i;
+	*c = (struct Column){.type = ColNum, .odd_row = -1};
+	c->num = xmalloc(rows * sizeof(int64_t));
+	for (i = 0; i < rows; i++)
+		{
+		char *s = m[i][j];
+		if (s == NULL)
+			c->num[i] = COL_NULL;
+		else if (*s == '\0')
+			c->num[i] = COL_EMPTY;
+		else if (col_number(s, &c->num[i]))
+			continue;
+		else if (i == 0)
+			{
+			c->num[i] = COL_NULL;
+			c->odd_row = 0;
+			c->odd = s;
+			}
+		else
+			break;
+		}
+	if (i == rows)
+		return;
+
+	/* Few distinct strings are kept once, cells point to them by a short code */
+	free(c->num);
+	*c = (struct Column){.type = ColDict, .odd_row = -1};
+	c->code = xmalloc(rows * sizeof(uint16_t));
+	c->dict = xmalloc(sizeof(char *));
+	c->dict[0] = NULL;
+	c->n_dict = 1;
+	int64_t limit = rows / DICT_RATIO < DICT_MAX ? rows / DICT_RATIO : DICT_MAX;
+	for (i = 0; i < rows; i++)
+		{
+		int code = col_code(c, m[i][j], limit);
+		if (code < 0)
+			break;
+		c->code[i] = code;
+		}
+	if (i == rows)
+		return;
+
+	free(c->code);
+	free(c->dict);
+	free(c->slot);
+	*c = (struct Column){.type = ColText, .odd_row = -1};
+	c->text = xmalloc(rows * sizeof(char *));
+	for (i = 0; i < rows; i++)
+		c->text[i] = m[i][j];
+	}
+
+void *
+col_chunk(void *arg)
+	{
+	struct ColJob *p = arg;
+	for (int64_t j = p->begin; j < p->end; j++)
+		col_infer(&matrice->col[j], j);
+	return NULL;
+	}
+
+void
+col_build(void)
+	{
+	if (matrice->virt != NULL || matrice->col != NULL)
+		return;
+	int64_t cols = matrice->cols;
+	int n = jobs < cols ? jobs : cols;
+	if (n < 1) n = 1;
+	struct ColJob p[n];
+	for (int i = 0; i < n; i++)
+		p[i] = (struct ColJob){cols * i / n, cols * (i + 1) / n};
+	dense_flat();
+	matrice->col = xmalloc((cols > 0 ? cols : 1) * sizeof(struct Column));
+	parallel(col_chunk, p, sizeof(*p), n);
+	free_matrix(&matrice->m, matrice->rows);
+	matrice->m = NULL;
+	malloc_trim(0); /* the rows were many small blocks, give the pages back */
+	/* Splitting dirtied the mapping, nothing reads it once the cells are elsewhere */
+	if (matrice->mapsize && uhead->prev == NULL && uhead->next == NULL && col_own())
+		madvise(matrice->buff, matrice->size, MADV_DONTNEED);
+	}
+
+int
+col_own(void)
+	{
+	/* Copy the strings left in buff, unless a text column needs all of it */
+	char *begin = matrice->buff, *end = matrice->buff + matrice->size;
+	size_t len = 0;
+	for (int64_t j = 0; j < matrice->cols; j++)
+		{
+		struct Column *c = &matrice->col[j];
+		if (c->type == ColText)
+			return 0;
+		if (c->odd_row >= 0)
+			len += strlen(c->odd) + 1;
+		for (int64_t d = 1; d < c->n_dict; d++)
+			len += strlen(c->dict[d]) + 1;
+		}
+	char *k = xmalloc(len + 1);
+	keep_text(k);
+	for (int64_t j = 0; j < matrice->cols; j++)
+		{
+		struct Column *c = &matrice->col[j];
+		if (c->odd_row >= 0 && c->odd >= begin && c->odd < end)
+			{
+			c->odd = strcpy(k, c->odd);
+			k += strlen(k) + 1;
+			}
+		for (int64_t d = 1; d < c->n_dict; d++)
+			{
+			if (c->dict[d] < begin || c->dict[d] >= end)
+				continue;
+			c->dict[d] = strcpy(k, c->dict[d]);
+			k += strlen(k) + 1;
+			}
+		}
+	return 1;
+	}
+
+void
+col_rows(void)
+	{
+	/* Back to rows of text for code that works on matrice->m directly */
+	if (matrice->col == NULL)
+		return;
+	for (int64_t j = 0; j < matrice->cols; j++)
+		col_text(&matrice->col[j]);
+	matrice->m = xmalloc(matrice->rows * sizeof(char **));
+	matrice->gap_len = 0;
+	for (int64_t i = 0; i < matrice->rows; i++)
+		{
+		matrice->m[i] = xmalloc(matrice->cols * sizeof(char *));
+		for (int64_t j = 0; j < matrice->cols; j++)
+			matrice->m[i][j] = matrice->col[j].text[i];
+		}
+	col_free();
+	}
+
+void
+col_text(struct Column *c)
+	{
+	/* A cell that does not fit the type turns the column back into strings */
+	int64_t rows = matrice->rows;
+	if (c->type == ColText)
+		return;
+	char **text = xmalloc(rows * sizeof(char *));
+	if (c->type == ColDict)
+		{
+		for (int64_t i = 0; i < rows; i++)
+			text[i] = c->dict[c->code[i]];
+		}
+	else
+		{
+		char buf[COL_TEXT];
+		size_t len = 0;
+		for (int64_t i = 0; i < rows; i++)
+			{
+			char *cell = col_format(c->num[i], buf);
+			if (cell != NULL)
+				len += strlen(cell) + 1;
+			}
+		char *k = xmalloc(len + 1);
+		keep_text(k);
+		for (int64_t i = 0; i < rows; i++)
+			{
+			char *cell = col_format(c->num[i], buf);
+			text[i] = cell != NULL ? strcpy(k, cell) : NULL;
+			if (cell != NULL)
+				k += strlen(cell) + 1;
+			}
+		if (c->odd_row >= 0)
+			text[c->odd_row] = c->odd;
+		}
+	col_drop(c);
+	*c = (struct Column){.type = ColText, .odd_row = -1};
+	c->text = text;
+	}
+
+size_t
+col_size(struct Column *c)
+	{
+	if (c->type == ColNum) return sizeof(int64_t);
+	if (c->type == ColDict) return sizeof(uint16_t);
+	return sizeof(char *);
+	}
+
+char *
+col_get(int64_t y, int64_t x)
+	{
+	struct Column *c = &matrice->col[x];
+	if (c->type == ColText)
+		return c->text[y];
+	if (c->type == ColDict)
+		return c->dict[c->code[y]];
+	if (y == c->odd_row)
+		return c->odd;
+	return col_shown(c, c->num[y]);
+	}
+
+void
+col_set(int64_t y, int64_t x, char *str)
+	{
+	struct Column *c = &matrice->col[x];
+	if (c->type == ColNum)
+		{
+		int64_t v = COL_NULL;
+		if (y == c->odd_row)
+			c->odd_row = -1;
+		if (str != NULL && *str == '\0')
+			v = COL_EMPTY;
+		else if (str != NULL && !col_number(str, &v))
+			{
+			if (c->odd_row < 0)
+				{
+				c->odd_row = y;
+				c->odd = str;
+				v = COL_NULL;
+				}
+			else
+				col_text(c);
+			}
+		if (c->type == ColNum)
+			{
+			c->num[y] = v;
+			return;
+			}
+		}
+	else if (c->type == ColDict)
+		{
+		int code = col_code(c, str, DICT_MAX);
+		if (code >= 0)
+			{
+			c->code[y] = code;
+			return;
+			}
+		col_text(c);
+		}
+	c->text[y] = str;
+	}
+
+char *
+col_take(int64_t y, int64_t x)
+	{
+	struct Column *c = &matrice->col[x];
+	char *temp = col_get(y, x);
+	if (c->type == ColNum && y == c->odd_row)
+		c->odd_row = -1;
+	else if (c->type == ColNum) /* Copy it, undo keeps it longer than the ring */
+		temp = arena_str(temp);
+	if (c->type == ColNum)
+		c->num[y] = COL_NULL;
+	else if (c->type == ColDict)
+		c->code[y] = 0;
+	else
+		c->text[y] = NULL;
+	return temp;
+	}
+
+void
+col_rows_insert(int64_t at, int64_t n)
+	{
+	for (int64_t j = 0; j < matrice->cols; j++)
+		{
+		struct Column *c = &matrice->col[j];
+		size_t size = col_size(c);
+		c->data = xrealloc(c->data, (matrice->rows + n) * size);
+		memmove((char *)c->data + (at + n) * size, (char *)c->data + at * size, (matrice->rows - at) * size);
+		for (int64_t i = at; i < at + n; i++)
+			{
+			if (c->type == ColNum) c->num[i] = COL_NULL;
+			else if (c->type == ColDict) c->code[i] = 0;
+			else c->text[i] = NULL;
+			}
+		if (c->odd_row >= at)
+			c->odd_row += n;
+		}
+	}
+
+void
+col_rows_cut(int64_t at, int64_t n)
+	{
+	for (int64_t j = 0; j < matrice->cols; j++)
+		{
+		struct Column *c = &matrice->col[j];
+		size_t size = col_size(c);
+		memmove((char *)c->data + at * size, (char *)c->data + (at + n) * size, (matrice->rows - at - n) * size);
+		if (c->odd_row >= at + n)
+			c->odd_row -= n;
+		else if (c->odd_row >= at)
+			c->odd_row = -1;
+		}
+	}
+
+void
+col_cols_insert(int64_t at, int64_t n)
+	{
+	matrice->col = xrealloc(matrice->col, (matrice->cols + n) * sizeof(struct Column));
+	memmove(matrice->col + at + n, matrice->col + at, (matrice->cols - at) * sizeof(struct Column));
+	for (int64_t j = at; j < at + n; j++)
+		{
+		struct Column *c = &matrice->col[j];
+		*c = (struct Column){.type = ColNum, .odd_row = -1};
+		c->num = xmalloc((matrice->rows > 0 ? matrice->rows : 1) * sizeof(int64_t));
+		for (int64_t i = 0; i < matrice->rows; i++)
+			c->num[i] = COL_NULL;
+		}
+	}
+
+void
+col_cols_cut(int64_t at, int64_t n)
+	{
+	for (int64_t j = at; j < at + n; j++)
+		col_drop(&matrice->col[j]);
+	memmove(matrice->col + at, matrice->col + at + n, (matrice->cols - at - n) * sizeof(struct Column));
+	}
+
+void
+col_free(void)
+	{
+	for (int64_t j = 0; j < matrice->cols; j++)
+		col_drop(&matrice->col[j]);
+	free(matrice->col);
+	matrice->col = NULL;
+	}
+
+void
+pack_build(char *base, size_t size)
+	{
+	/* Rows read in batches point into many buffers, offsets would not reach them */
+	if (!packing || matrice->virt != NULL || matrice->col != NULL || matrice->pack != NULL
+			|| load != NULL || follow != NULL || size >= PACK_MAX)
+		return;
+	dense_flat();
+	int64_t rows = matrice->rows, cols = matrice->cols;
+	struct Pack *k = xmalloc(sizeof(struct Pack));
+	*k = (struct Pack){.width = cols, .base = base, .size = size};
+	k->ref = xmalloc((rows * cols > 0 ? rows * cols : 1) * sizeof(uint32_t));
+	k->map = xmalloc((cols > 0 ? cols : 1) * sizeof(int64_t));
+	for (int64_t j = 0; j < cols; j++)
+		k->map[j] = j;
+	for (int64_t i = 0; i < rows; i++)
+		{
+		for (int64_t j = 0; j < cols; j++)
+			k->ref[i * cols + j] = pack_enc(k, matrice->m[i][j]);
+		free(matrice->m[i]);
+		}
+	free(matrice->m);
+	matrice->m = NULL;
+	matrice->gap_len = 0;
+	matrice->pack = k;
+	malloc_trim(0); /* the rows were many small blocks, give the pages back */
+	}
+
+uint32_t
+pack_enc(struct Pack *k, char *s)
+	{
+	if (s == NULL)
+		return 0;
+	if (s >= k->base && s < k->base + k->size)
+		return s - k->base + 1;
+	uint32_t i;
+	if (k->n_hole > 0)
+		i = k->hole[--k->n_hole];
+	else
+		{
+		if (k->n_str == k->cap)
+			{
+			k->cap = k->cap ? 2 * k->cap : 64;
+			k->str = xrealloc(k->str, k->cap * sizeof(char *));
+			k->hole = xrealloc(k->hole, k->cap * sizeof(uint32_t));
+			}
+		i = k->n_str++;
+		}
+	k->str[i] = s;
+	return PACK_TAG | i;
+	}
+
+char *
+pack_dec(struct Pack *k, uint32_t r)
+	{
+	if (r & PACK_TAG)
+		return k->str[r & ~PACK_TAG];
+	return r == 0 ? NULL : k->base + r - 1;
+	}
+
+void
+pack_drop(struct Pack *k, uint32_t r)
+	{
+	/* The string itself belongs to the arena or the undo history */
+	if (!(r & PACK_TAG))
+		return;
+	k->str[r & ~PACK_TAG] = NULL;
+	k->hole[k->n_hole++] = r & ~PACK_TAG;
+	}
+
+uint32_t *
+pack_ref(int64_t y, int64_t x)
+	{
+	struct Pack *k = matrice->pack;
+	int64_t r = y < k->gap ? y : y + k->gap_len;
+	int64_t p = k->map[x];
+	if (p < k->width)
+		return &k->ref[r * k->width + p];
+	return &k->xref[p - k->width][r];
+	}
+
+void
+pack_move(int64_t at)
+	{
+	struct Pack *k = matrice->pack;
+	int64_t len = k->gap_len, gap = k->gap;
+	for (int64_t j = -1; len > 0 && j < k->n_xref; j++)
+		{
+		uint32_t *m = j < 0 ? k->ref : k->xref[j];
+		size_t w = j < 0 ? k->width : 1;
+		if (at < gap)
+			memmove(m + (at + len) * w, m + at * w, (gap - at) * w * sizeof(uint32_t));
+		else if (at > gap)
+			memmove(m + gap * w, m + (gap + len) * w, (at - gap) * w * sizeof(uint32_t));
+		}
+	k->gap = at;
+	}
+
+int64_t
+pack_slot(void)
+	{
+	/* Cut columns were cleared, so a spare slot is ready as it is */
+	struct Pack *k = matrice->pack;
+	if (k->n_spare > 0)
+		return k->spare[--k->n_spare];
+	int64_t len = matrice->rows + k->gap_len;
+	uint32_t *cells = calloc(len > 0 ? len : 1, sizeof(uint32_t));
+	if (cells == NULL)
+		{
+		fprintf(stderr, "calloc: %s\n", strerror(errno));
+		die();
+		exit(EXIT_FAILURE);
+		}
+	k->xref = xrealloc(k->xref, (k->n_xref + 1) * sizeof(uint32_t *));
+	k->xref[k->n_xref] = cells;
+	return k->width + k->n_xref++;
+	}
+
+void
+pack_rows(void)
+	{
+	/* Back to rows of pointers for code that works on matrice->m directly */
+	if (matrice->pack == NULL)
+		return;
+	int64_t rows = matrice->rows, cols = matrice->cols;
+	matrice->m = xmalloc((rows > 0 ? rows : 1) * sizeof(char **));
+	matrice->gap = matrice->gap_len = 0;
+	for (int64_t i = 0; i < rows; i++)
+		{
+		matrice->m[i] = xmalloc((cols > 0 ? cols : 1) * sizeof(char *));
+		for (int64_t j = 0; j < cols; j++)
+			matrice->m[i][j] = pack_get(i, j);
+		}
+	pack_free();
+	}
+
+char *
+pack_get(int64_t y, int64_t x)
+	{
+	return pack_dec(matrice->pack, *pack_ref(y, x));
+	}
+
+void
+pack_set(int64_t y, int64_t x, char *str)
+	{
+	uint32_t *r = pack_ref(y, x);
+	pack_drop(matrice->pack, *r);
+	*r = pack_enc(matrice->pack, str);
+	}
+
+char *
+pack_take(int64_t y, int64_t x)
+	{
+	uint32_t *r = pack_ref(y, x);
+	char *temp = pack_dec(matrice->pack, *r);
+	pack_drop(matrice->pack, *r);
+	*r = 0;
+	return temp;
+	}
+
+void
+pack_rows_insert(int64_t at, int64_t n)
+	{
+	struct Pack *k = matrice->pack;
+	if (k->gap_len < n)
+		{
+		pack_move(matrice->rows);
+		int64_t len = n + matrice->rows / 8 + GAP_ROWS;
+		int64_t size = (matrice->rows + len) * k->width;
+		k->ref = xrealloc(k->ref, (size > 0 ? size : 1) * sizeof(uint32_t));
+		for (int64_t j = 0; j < k->n_xref; j++)
+			k->xref[j] = xrealloc(k->xref[j], (matrice->rows + len) * sizeof(uint32_t));
+		k->gap_len = len;
+		}
+	pack_move(at);
+	memset(k->ref + at * k->width, 0, n * k->width * sizeof(uint32_t));
+	for (int64_t j = 0; j < k->n_xref; j++)
+		memset(k->xref[j] + at, 0, n * sizeof(uint32_t));
+	k->gap += n;
+	k->gap_len -= n;
+	}
+
+void
+pack_rows_cut(int64_t at, int64_t n)
+	{
+	struct Pack *k = matrice->pack;
+	for (int64_t i = at; i < at + n; i++)
+		{
+		for (int64_t j = 0; j < matrice->cols; j++)
+			pack_drop(k, *pack_ref(i, j));
+		}
+	pack_move(at + n);
+	k->gap -= n;
+	k->gap_len += n;
+	}
+
+void
+pack_cols_insert(int64_t at, int64_t n)
+	{
+	struct Pack *k = matrice->pack;
+	k->map = xrealloc(k->map, (matrice->cols + n) * sizeof(int64_t));
+	memmove(k->map + at + n, k->map + at, (matrice->cols - at) * sizeof(int64_t));
+	for (int64_t j = at; j < at + n; j++)
+		k->map[j] = pack_slot();
+	}
+
+void
+pack_cols_cut(int64_t at, int64_t n)
+	{
+	struct Pack *k = matrice->pack;
+	for (int64_t j = at; j < at + n; j++)
+		{
+		for (int64_t i = 0; i < matrice->rows; i++)
+			{
+			uint32_t *r = pack_ref(i, j);
+			pack_drop(k, *r);
+			*r = 0;
+			}
+		}
+	k->spare = xrealloc(k->spare, (k->n_spare + n) * sizeof(int64_t));
+	memcpy(k->spare + k->n_spare, k->map + at, n * sizeof(int64_t));
+	k->n_spare += n;
+	memmove(k->map + at, k->map + at + n, (matrice->cols - at - n) * sizeof(int64_t));
+	}
+
+void
+pack_free(void)
+	{
+	struct Pack *k = matrice->pack;
+	for (int64_t j = 0; j < k->n_xref; j++)
+		free(k->xref[j]);
+	free(k->xref);
+	free(k->ref);
+	free(k->map);
+	free(k->spare);
+	free(k->str);
+	free(k->hole);
+	free(k);
+	matrice->pack = NULL;
+	}
+
+void
+sparse_build(void)
+	{
+	/* Wide tables that are mostly empty keep only their cells with text */
+	if (columnar || packing || matrice->virt != NULL || matrice->col != NULL || matrice->pack != NULL
+			|| matrice->sparse != NULL || matrice->cols < SPARSE_COLS)
+		return;
+	dense_flat();
+	int64_t rows = matrice->rows, cols = matrice->cols, full = 0;
+	for (int64_t i = 0; i < rows; i++)
+		{
+		for (int64_t j = 0; j < cols; j++)
+			full += matrice->m[i][j] != NULL && *matrice->m[i][j] != '\0';
+		}
+	if (full * SPARSE_RATIO >= rows * cols)
+		return;
+	matrice->sparse = xmalloc((rows > 0 ? rows : 1) * sizeof(struct SparseRow));
+	for (int64_t i = 0; i < rows; i++)
+		{
+		char **row = matrice->m[i];
+		struct SparseRow *r = &matrice->sparse[i];
+		*r = (struct SparseRow){0};
+		for (int64_t j = 0; j < cols; j++)
+			{
+			if (row[j] != NULL)
+				r->len = j + 1;
+			r->n += row[j] != NULL && *row[j] != '\0';
+			}
+		r->cap = r->n;
+		r->cell = r->n > 0 ? xmalloc(r->n * sizeof(struct SparseCell)) : NULL;
+		for (int64_t j = 0, k = 0; k < r->n; j++)
+			{
+			if (row[j] != NULL && *row[j] != '\0')
+				r->cell[k++] = (struct SparseCell){j, row[j]};
+			}
+		free(row);
+		}
+	free(matrice->m);
+	matrice->m = NULL;
+	matrice->gap_len = 0;
+	malloc_trim(0);
+	}
+
+int32_t
+sparse_find(struct SparseRow *r, int64_t x)
+	{
+	/* First cell at column x or after */
+	int32_t lo = 0, hi = r->n;
+	while (lo < hi)
+		{
+		int32_t mid = (lo + hi) / 2;
+		if (r->cell[mid].col < x)
+			lo = mid + 1;
+		else
+			hi = mid;
+		}
+	return lo;
+	}
+
+void
+sparse_rows(void)
+	{
+	/* Back to full rows for code that works on matrice->m directly */
+	if (matrice->sparse == NULL)
+		return;
+	int64_t rows = matrice->rows, cols = matrice->cols;
+	matrice->m = xmalloc((rows > 0 ? rows : 1) * sizeof(char **));
+	matrice->gap = matrice->gap_len = 0;
+	for (int64_t i = 0; i < rows; i++)
+		{
+		matrice->m[i] = xmalloc((cols > 0 ? cols : 1) * sizeof(char *));
+		for (int64_t j = 0; j < cols; j++)
+			matrice->m[i][j] = sparse_get(i, j);
+		}
+	sparse_free();
+	}
+
+char *
+sparse_get(int64_t y, int64_t x)
+	{
+	struct SparseRow *r = &matrice->sparse[y];
+	if (x >= r->len)
+		return NULL;
+	int32_t k = sparse_find(r, x);
+	return k < r->n && r->cell[k].col == x ? r->cell[k].s : "";
+	}
+
+void
+sparse_set(int64_t y, int64_t x, char *str)
+	{
+	/* Empty and missing cells inside the row are both left out, they read as "" */
+	struct SparseRow *r = &matrice->sparse[y];
+	if (str != NULL && x >= r->len)
+		r->len = x + 1;
+	int32_t k = sparse_find(r, x);
+	int hit = k < r->n && r->cell[k].col == x;
+	if (str == NULL || *str == '\0')
+		{
+		if (hit)
+			memmove(r->cell + k, r->cell + k + 1, (--r->n - k) * sizeof(struct SparseCell));
+		return;
+		}
+	if (!hit)
+		{
+		if (r->n == r->cap)
+			{
+			r->cap = r->cap ? 2 * r->cap : 4;
+			r->cell = xrealloc(r->cell, r->cap * sizeof(struct SparseCell));
+			}
+		memmove(r->cell + k + 1, r->cell + k, (r->n++ - k) * sizeof(struct SparseCell));
+		r->cell[k].col = x;
+		}
+	r->cell[k].s = str;
+	}
+
+char *
+sparse_take(int64_t y, int64_t x)
+	{
+	char *temp = sparse_get(y, x);
+	sparse_set(y, x, NULL);
+	return temp;
+	}
+
+void
+sparse_rows_insert(int64_t at, int64_t n)
+	{
+	matrice->sparse = xrealloc(matrice->sparse, (matrice->rows + n) * sizeof(struct SparseRow));
+	memmove(matrice->sparse + at + n, matrice->sparse + at, (matrice->rows - at) * sizeof(struct SparseRow));
+	for (int64_t i = at; i < at + n; i++)
+		matrice->sparse[i] = (struct SparseRow){0};
+	}
+
+void
+sparse_rows_cut(int64_t at, int64_t n)
+	{
+	for (int64_t i = at; i < at + n; i++)
+		free(matrice->sparse[i].cell);
+	memmove(matrice->sparse + at, matrice->sparse + at + n, (matrice->rows - at - n) * sizeof(struct SparseRow));
+	}
+
+void
+sparse_cols_insert(int64_t at, int64_t n)
+	{
+	for (int64_t i = 0; i < matrice->rows; i++)
+		{
+		struct SparseRow *r = &matrice->sparse[i];
+		if (r->len > at)
+			r->len += n;
+		for (int32_t k = sparse_find(r, at); k < r->n; k++)
+			r->cell[k].col += n;
+		}
+	}
+
+void
+sparse_cols_cut(int64_t at, int64_t n)
+	{
+	for (int64_t i = 0; i < matrice->rows; i++)
+		{
+		struct SparseRow *r = &matrice->sparse[i];
+		if (r->len > at)
+			r->len = r->len > at + n ? r->len - n : at;
+		int32_t k = sparse_find(r, at), end = sparse_find(r, at + n);
+		if (end > k)
+			memmove(r->cell + k, r->cell + end, (r->n - end) * sizeof(struct SparseCell));
+		r->n -= end - k;
+		for (; k < r->n; k++)
+			r->cell[k].col -= n;
+		}
+	}
+
+void
+sparse_free(void)
+	{
+	for (int64_t i = 0; i < matrice->rows; i++)
+		free(matrice->sparse[i].cell);
+	free(matrice->sparse);
+	matrice->sparse = NULL;
+	}
+
+char *
+arena_slab(struct Arena *a, size_t size)
+	{
+	a->slab = xrealloc(a->slab, (a->n + 1) * sizeof(struct Slab));
+	a->slab[a->n] = (struct Slab){xmalloc(size), size};
+	return a->slab[a->n++].buff;
+	}
+
+char *
+arena_str(const char *s)
+	{
+	/* Edited strings are not freed one by one, arena_compact() drops the dead ones */
+	if (s == NULL)
+		return NULL;
+	if (*s == '\0')
+		return ""; /* so a NUL first byte can mark a moved string */
+	struct Arena *a = &matrice->arena;
+	char **slot = NULL;
+	if (interning && (slot = intern_slot(a, s)) && *slot != NULL)
+		return *slot;
+	size_t len = strlen(s) + 1;
+	char *p;
+	if (len > ARENA_BIG)
+		p = arena_slab(a, len);
+	else
+		{
+		if ((size_t)(a->end - a->pos) < len)
+			{
+			a->pos = arena_slab(a, ARENA_CHUNK);
+			a->end = a->pos + ARENA_CHUNK;
+			}
+		p = a->pos;
+		a->pos += len;
+		}
+	a->bytes += len;
+	memcpy(p, s, len);
+	if (slot != NULL)
+		{
+		*slot = p;
+		a->used++;
+		}
+	return p;
+	}
+
+int
+slab_cmp(const void *a, const void *b)
+	{
+	uintptr_t l = (uintptr_t)((struct Slab *)a)->buff, r = (uintptr_t)((struct Slab *)b)->buff;
+	return (l > r) - (l < r);
+	}
+
+int
+slab_find(struct Arena *a, char *s)
+	{
+	/* Whether s lies in one of the slabs, sorted by address */
+	if (s == NULL || a->n == 0)
+		return 0;
+	struct Slab *last = &a->slab[a->n - 1];
+	if (s < a->slab[0].buff || s >= last->buff + last->size)
+		return 0;
+	int64_t lo = 0, hi = a->n;
+	while (hi - lo > 1)
+		{
+		int64_t mid = (lo + hi) / 2;
+		if (a->slab[mid].buff <= s)
+			lo = mid;
+		else
+			hi = mid;
+		}
+	return s < a->slab[lo].buff + a->slab[lo].size;
+	}
+
+char **
+intern_slot(struct Arena *a, const char *s)
+	{
+	/* Slot of the shared string equal to s, or the free one it goes in */
+	if (2 * (a->used + 1) > a->cap)
+		{
+		size_t cap = a->cap;
+		char **set = a->set;
+		a->cap = cap ? cap * 2 : INTERN_MIN;
+		a->set = xmalloc(a->cap * sizeof(char *));
+		for (size_t i = 0; i < a->cap; i++)
+			a->set[i] = NULL;
+		for (size_t i = 0; i < cap; i++)
+			{
+			if (set[i] == NULL) continue;
+			size_t l = hash_str(set[i]) & (a->cap - 1);
+			while (a->set[l] != NULL)
+				l = (l + 1) & (a->cap - 1);
+			a->set[l] = set[i];
+			}
+		free(set);
+		}
+	size_t i = hash_str((char *)s) & (a->cap - 1);
+	while (a->set[i] != NULL && strcmp(a->set[i], s) != 0)
+		i = (i + 1) & (a->cap - 1);
+	return &a->set[i];
+	}
+
+char *
+intern_str(char *s)
+	{
+	/* s stays valid as long as the table, it is shared as it is */
+	if (s == NULL || *s == '\0')
+		return s;
+	char **slot = intern_slot(&matrice->arena, s);
+	if (*slot == NULL)
+		{
+		*slot = s;
+		matrice->arena.used++;
+		}
+	return *slot;
+	}
+
+void
+intern_table(void)
+	{
+	/* Columns with many distinct values are left alone, the set would cost more than it saves */
+	if (matrice->virt != NULL || matrice->col != NULL || matrice->pack != NULL || matrice->sparse != NULL)
+		return;
+	int64_t limit = matrice->rows / DICT_RATIO;
+	for (int64_t j = 0; j < matrice->cols; j++)
+		{
+		size_t used = matrice->arena.used;
+		for (int64_t i = 0; i < matrice->rows && matrice->arena.used - used <= (size_t)limit; i++)
+			{
+			char **cell = dense_cell(i, j);
+			*cell = intern_str(*cell);
+			}
+		}
+	}
+
+void
+arena_move(struct Arena *old, char **cell)
+	{
+	char *s = *cell;
+	if (!slab_find(old, s))
+		return;
+	if (*s == '\0') /* moved, the new address follows */
+		{
+		memcpy(cell, s + 1, sizeof(char *));
+		return;
+		}
+	/* Strings too short to hold the new address are copied for every reference */
+	size_t len = strlen(s) + 1;
+	*cell = arena_str(s);
+	if (len > sizeof(char *))
+		{
+		*s = '\0';
+		memcpy(s + 1, cell, sizeof(char *));
+		}
+	}
+
+void
+arena_compact(void)
+	{
+	/* Copy the strings the table and the undo history still point at into fresh slabs */
+	struct Arena old = matrice->arena;
+	if (old.bytes < ARENA_CHUNK)
+		{
+		if (interning) /* the arena stays small, but freed undo rows still hold pages */
+			malloc_trim(0);
+		return;
+		}
+	qsort(old.slab, old.n, sizeof(struct Slab), slab_cmp);
+	matrice->arena = (struct Arena){0};
+	disp_gen++; /* the strings move and their old slabs are freed */
+	for (size_t i = 0; i < old.cap; i++)
+		{
+		if (old.set[i] != NULL && !slab_find(&old, old.set[i]))
+			intern_str(old.set[i]);
+		}
+	if (matrice->virt != NULL)
+		{
+		struct Virt *v = matrice->virt;
+		for (size_t i = 0; i < v->cap; i++)
+			{
+			for (int64_t j = 0; v->val[i] != NULL && j < matrice->cols; j++)
+				arena_move(&old, &v->val[i][j]);
+			}
+		}
+	else if (matrice->col != NULL)
+		{
+		for (int64_t j = 0; j < matrice->cols; j++)
+			{
+			struct Column *c = &matrice->col[j];
+			if (c->type == ColText)
+				{
+				for (int64_t i = 0; i < matrice->rows; i++)
+					arena_move(&old, &c->text[i]);
+				}
+			else if (c->type == ColDict)
+				{
+				for (int64_t d = 1; d < c->n_dict; d++)
+					arena_move(&old, &c->dict[d]);
+				}
+			else if (c->odd_row >= 0)
+				arena_move(&old, &c->odd);
+			}
+		}
+	else if (matrice->pack != NULL)
+		{
+		for (uint32_t i = 0; i < matrice->pack->n_str; i++)
+			arena_move(&old, &matrice->pack->str[i]);
+		}
+	else if (matrice->sparse != NULL)
+		{
+		for (int64_t i = 0; i < matrice->rows; i++)
+			{
+			for (int32_t k = 0; k < matrice->sparse[i].n; k++)
+				arena_move(&old, &matrice->sparse[i].cell[k].s);
+			}
+		}
+	else
+		{
+		for (int64_t i = 0; i < matrice->rows; i++)
+			{
+			for (int64_t j = 0; j < matrice->cols; j++)
+				arena_move(&old, dense_cell(i, j));
+			}
+		}
+	node_t *node = uhead;
+	while (node != NULL && node->prev != NULL)
+		node = node->prev;
+	for (; node != NULL; node = node->next)
+		{
+		for (int i = 0; i < node->dc; i++)
+			{
+			struct undo *u = &node->data[i];
+			arena_move(&old, &u->cell);
+			for (int64_t r = 0; u->mat != NULL && r < u->rows; r++)
+				{
+				for (int64_t c = 0; c < u->cols; c++)
+					arena_move(&old, &u->mat[r][c]);
+				}
+			}
+		}
+	for (int64_t i = 0; i < old.n; i++)
+		free(old.slab[i].buff);
+	free(old.slab);
+	free(old.set);
+	matrice->arena.bytes = 0;
+	malloc_trim(0);
+	}
+
+void
+init_ui(void)
+	{
+	setlocale(LC_ALL, "");
+	/* Keys come from the terminal when the table is piped in */
+	FILE *tty;
+	if (isatty(STDIN_FILENO))
+		initscr();
+	else if ((tty = fopen("/dev/tty", "r")) == NULL || newterm(NULL, stdout, tty) == NULL)
+		exit(EXIT_FAILURE);
+	cbreak();
+	raw();
+	noecho();
+	idlok(stdscr, TRUE); /* scroll with the terminal's own line moves */
+	keypad(stdscr, TRUE);
+	mousemask(BUTTON1_PRESSED | BUTTON4_PRESSED | BUTTON5_PRESSED, NULL);
+	mouseinterval(0);
+	}
+
+void
+usage(void)
+	{
+	fprintf(stderr, "Uporaba: %s [-v] [-s] [-c] [-i] [-p] [-a] [-t] [-F] [-f separator|auto] [-j threads] [file]\n", argv0);
+	exit(EXIT_FAILURE);
+	}
+
+int
+main(int argc, char *argv[])
+	{
+	FILE *file = NULL;
+	char *val = NULL;
+	int virt = 0;
+	int tail = 0;
+	jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	ARGBEGIN
+		{
+		case 'v':
+			virt = 1;
+			break;
+		case 's':
+			sidecar = 1;
+			break;
+		case 'c':
+			columnar = 1;
+			break;
+		case 'i':
+			interning = 1;
+			break;
+		case 'p':
+			packing = 1;
+			break;
+		case 'a':
+			autofit = 1;
+			break;
+		case 't':
+			timing = 1;
+			break;
+		case 'F':
+			tail = 1;
+			break;
+		case 'j':
+			jobs = atoi(EARGF(usage()));
+			if (jobs < 1)
+				usage();
+			break;
+		case 'f':
+			val = EARGF(usage());
+			if (strlen(val) == 1)
+				fs = val[0];
+			else if (strcmp(val, "\\t") == 0)
+				fs = '\t';
+			else if (strcmp(val, "auto") == 0)
+				detect = 1;
+			else
+				usage();
+			break;
+		default:
+			usage();
+		}
+	ARGEND;
+	if (argc > 0)
+		{
+		fname = strdup(argv[0]);
+		if (fname == NULL) exit(EXIT_FAILURE);
+		printf("\033]0;%s - csvis\a", fname);
+		fflush(stdout);
+		file = fopen(fname, "r");
+		}
+	else
+		{
+		fname = NULL;
+		printf("\033]0;[No name] - csvis\a");
+		fflush(stdout);
+		}
+	matrice = malloc(sizeof(struct Mat));
+	if (matrice == NULL)
+		{
+		free(fname);
+		exit(EXIT_FAILURE);
+		}
+	matrice->virt = NULL;
+	matrice->col = NULL;
+	matrice->pack = NULL;
+	matrice->sparse = NULL;
+	matrice->gap = matrice->gap_len = 0;
+	matrice->colmap = NULL;
+	matrice->xcol = NULL;
+	matrice->n_xcol = 0;
+	matrice->spare = NULL;
+	matrice->n_spare = 0;
+	matrice->arena = (struct Arena){0};
+	matrice->texts = NULL;
+	matrice->n_texts = 0;
+	classify_init();
+	pid_t pid = 0;
+	struct Codec *codec = codec_magic(file);
+	FILE *unpacked = codec != NULL ? codec_open(file, codec, 0, &pid) : NULL;
+	if (unpacked != NULL)
+		{
+		fclose(file);
+		file = unpacked;
+		}
+	int64_t t0 = perf_begin();
+	matrice->mapsize = mapall(file, &matrice->buff, &matrice->size);
+	struct stat st;
+	if (matrice->mapsize && fstat(fileno(file), &st) == 0)
+		{
+		matrice->dev = st.st_dev;
+		matrice->ino = st.st_ino;
+		}
+	if (matrice->mapsize == 0 && (tail || pid > 0))
+		readall(NULL, &matrice->buff, &matrice->size);
+	else if (matrice->mapsize == 0)
+		readall(file, &matrice->buff, &matrice->size);
+	perf_end(PerfRead, t0);
+	if (tail || pid > 0)
+		{
+		follow_start(file, tail);
+		follow->pid = pid;
+		follow->prog = codec != NULL ? codec->prog : NULL;
+		}
+	/* Streams are sniffed on their first batch instead of the placeholder */
+	if (follow == NULL || !follow->fresh)
+		detect_dialect(matrice->buff, matrice->buff + matrice->size);
+	/* Splitting every cell takes about as much memory again as the file */
+	long pages = sysconf(_SC_PHYS_PAGES);
+	if (pages > 0 && matrice->size / sysconf(_SC_PAGESIZE) > (size_t)pages / 4)
+		virt = 1;
+	virt = virt && matrice->mapsize && !tail && virt_open();
+	if (!virt && matrice->mapsize && matrice->size > LOAD_ASYNC)
+		load_start();
+	else if (!virt)
+		matrice->m = write_to_matrix(&matrice->buff, &matrice->rows, &matrice->cols);
+	if (matrice->mapsize && load == NULL)
+		madvise(matrice->buff, matrice->size, MADV_NORMAL);
+	uhead = xmalloc(sizeof(node_t));
+	uhead->data = NULL;
+	uhead->dc = 0;
+	uhead->next = NULL;
+	uhead->prev = NULL;
+	/* Decompressed text is parsed a batch at a time as it arrives */
+	while (follow != NULL && !tail && follow->fd >= 0)
+		follow_rows();
+	if (follow != NULL && follow->failed)
+		{
+		init_ui();
+		getmaxyx(stdscr, rows, cols);
+		codec_failed();
+		die();
+		exit(EXIT_FAILURE);
+		}
+	sparse_build();
+	if (columnar && load == NULL)
+		col_build();
+	else if (interning && load == NULL)
+		intern_table();
+	if (load == NULL)
+		pack_build(matrice->buff, matrice->size);
+	if (autofit)
+		fit_start();
+
+	if (file != NULL && follow == NULL)
+		fclose(file);
+
+	if (fname != NULL && stat(fname, &st) != 0)
+		return -1;
+	if (fname != NULL)
+		m_time = st.st_mtime;
+
+	init_ui();
+	int key;
+	int redraw = 1;
+
+	while (1)
+		{
+		if (load_rows())
+			redraw = 1;
+		if (follow_rows())
+			redraw = 1;
+		if (fit_rows())
+			redraw = 1;
+		if (redraw == 1)
+			{
+			when_resize();
+			draw();
+			frame_ms = now_ms();
+			frames_drawn++;
+			if (timing)
+				perf_paint();
+			}
+		/* While loading or following wake up to take in new rows, go on at once with the widths */
+		if (fit != NULL && !fit->idle)
+			timeout(0);
+		else
+			timeout(load != NULL || (follow != NULL && follow->fd >= 0) ? LOAD_TICK : -1);
+		key = getch();
+		timeout(-1);
+		if (key == ERR)
+			redraw = 0;
+		else
+			redraw = take_keys(key);
 		}
 	}
@@ -0,0 +1,54 @@
+/* See LICENSE for license details. */
+
+/* Opens a table the way csvis -v does and checks its size, for tables
+ * with more than 2^31 cells: make stress */
+
+#define main csvis_main
+#include "main.c"
+#undef main
+
+int
+main(int argc, char *argv[])
+	{
+	if (argc != 4)
+		{
+		fprintf(stderr, "usage: %s file rows cols\n", argv[0]);
+		return EXIT_FAILURE;
+		}
+	int64_t rows = atoll(argv[2]), cols = atoll(argv[3]);
+	jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (jobs < 1) jobs = 1;
+	FILE *file = fopen(argv[1], "r");
+	if (file == NULL)
+		{
+		perror(argv[1]);
+		return EXIT_FAILURE;
+		}
+	matrice = calloc(1, sizeof(struct Mat));
+	classify_init();
+	matrice->mapsize = mapall(file, &matrice->buff, &matrice->size);
+	if (matrice->mapsize == 0 || !virt_open())
+		{
+		fprintf(stderr, "%s: not opened as a virtual table\n", argv[1]);
+		return EXIT_FAILURE;
+		}
+	while (load != NULL)
+		{
+		load_rows();
+		usleep(LOAD_TICK * 1000);
+		}
+
+	/* The first column holds the line number, so the last row shows it was reached */
+	char last[32];
+	snprintf(last, sizeof(last), "%lld", (long long)rows);
+	char *cell = get_cell(matrice->rows - 1, 0);
+	printf("%lld rows, %lld columns, %lld cells\n", (long long)matrice->rows,
+			(long long)matrice->cols, (long long)(matrice->rows * matrice->cols));
+	if (matrice->rows != rows || matrice->cols != cols || cell == NULL || strcmp(cell, last) != 0)
+		{
+		fprintf(stderr, "expected %lld rows, %lld columns, ending with row %s\n",
+				(long long)rows, (long long)cols, last);
+		return EXIT_FAILURE;
+		}
+	return EXIT_SUCCESS;
+	}